@@ -1,10 +1,13 @@
 // Virtual cable program to test serial port.
-// Creates a pair of virtual Tx / Rx serial ports using "socat".
+// Creates a pair of virtual Tx / Rx serial ports using pseudo-terminals.
 //
 // Author: Manuel Ricardo [mricardo@fe.up.pt]
 // Modified by: Eduardo Nuno Almeida [enalmeida@fe.up.pt]
 // Modified by: Rui Prior [rcprior@fc.up.pt]
+//
+// Build with: gcc cable.c -o cable -pthread
 
+#define _GNU_SOURCE     // For posix_openpt() and cfmakeraw()
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -14,78 +17,462 @@
 #include <termios.h>
 #include <unistd.h>
 #include <time.h>
-#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <math.h>
+#include "cable_clock.h"
 
+// Ports of the first link; link n uses /dev/ttyS(10+2n) and /dev/ttyS(11+2n)
+// unless given with -l
 #define TXDEV "/dev/ttyS10"
 #define RXDEV "/dev/ttyS11"
-// Baudrate settings are defined in <asm/termbits.h>, which is
-// included by <termios.h>
-#define BAUDRATE B9600  // For struct termios
+#define DEV_PREFIX "/dev/ttyS"
+#define FIRST_DEV_NUMBER 10
+#define MAX_LINKS 256
+#define MAX_DEV_NAME 64
+#define MAX_STATIONS 32   // Ports on a bus, primary included
+// Shared clock of each link, linked from "<port>.clock"
+#define CLOCK_DIR "/dev/shm/"
+#define DEFAULT_GRACE_DELAY 1000  // usec
 #define DEFAULT_BAUDRATE 9600  // For the delaying transmissions
+#define MAX_BAUDRATE 100000000  // Keeps the slot time arithmetic within 64 bits
+#define NSEC_PER_BYTE_BAUD 10000000000ULL  // 10 bit times per byte, in nsec
 #define _POSIX_SOURCE 1 // POSIX compliant source
 #define FALSE 0
 #define TRUE 1
 
 #define BUF_SIZE 2048
 
+// Lateness histogram: 1 usec buckets up to HIST_LINEAR usec, then one bucket
+// per power of two
+#define HIST_LINEAR 1024
+#define HIST_LOG 32
+
+struct histogram {
+    unsigned long long count[HIST_LINEAR + HIST_LOG];
+    unsigned long long total;
+    long long max;     // nsec
+};
+
+// Channel states of the Gilbert-Elliott burst error model
+#define GOOD 0
+#define BAD 1
+
+// Bit error generator for one direction of the cable.
+// Instead of drawing a random number per byte, the number of clean bits
+// before the next error is drawn from a geometric distribution, so a byte
+// without errors only costs a counter decrement. The time spent in each
+// state of the burst error model is drawn the same way.
+struct channel {
+    uint64_t rng[4];        // xoshiro256** state
+    int state;              // GOOD or BAD
+    uint64_t bitsToError;   // Clean bits before the next flipped one
+    uint64_t bitsToSwitch;  // Bits before the channel changes state
+};
+
+// Capture of the delivered bytes. The forwarding loop pushes each byte with
+// its slot time into a lock-free single-producer / single-consumer ring per
+// direction, and a separate thread writes them to a pcap file.
+#define CAPTURE_SIZE 65536  // Records per direction, must be a power of two
+#define CAPTURE_FRAME_MAX 65535
+// Records are the bytes of a frame exactly as on the line, flags and
+// escapes included, after a direction byte (1 = sent by Tx, 0 = by Rx). No
+// standard link type fits: the address and control fields are neither
+// PPP's nor LAPB's. In Wireshark, decode DLT_USER0 with a dissector of the
+// frames of link_layer.c, or show the bytes as data.
+#define LINKTYPE_USER0 147
+
+struct capture_record {
+    uint64_t nsec;   // Slot time of the byte (link time)
+    unsigned char byte;
+};
+
+struct capture_ring {
+    struct capture_record rec[CAPTURE_SIZE];
+    _Atomic uint64_t head;   // Next record to write, owned by the producer
+    _Atomic uint64_t tail;   // Next record to read, owned by the consumer
+    unsigned long long lost; // Bytes not captured because the ring was full
+};
+
+// Log of the bytes entering and leaving the ring buffers. As for the
+// capture, the forwarding loop only pushes one record per slot into a
+// lock-free ring, and a separate thread formats and writes them, so that a
+// slow disk never holds the link back. Commands also push records, but
+// always with the link locked, so there is still a single producer at a time.
+#define LOG_SIZE 65536      // Records, must be a power of two
+#define LOG_IN(dir) (1 << (2 * (dir)))       // byte[2 * dir] entered
+#define LOG_OUT(dir) (1 << (2 * (dir) + 1))  // byte[2 * dir + 1] left
+#define LOG_BUS 0x10        // Bus mode, a single direction
+#define LOG_CABLE_OFF 0x20
+
+struct log_record {
+    unsigned char flags;    // Nothing for the start of an idle period
+    unsigned char byte[4];
+};
+
+struct logger {
+    FILE *file;
+    pthread_t thread;
+    atomic_int stop;
+    struct log_record rec[LOG_SIZE];
+    _Atomic uint64_t head;   // Next record to write, owned by the producer
+    _Atomic uint64_t tail;   // Next record to read, owned by the consumer
+    unsigned long long lost; // Slots not logged because the ring was full
+};
+
+// Frame being assembled by the capture thread for one direction
+struct capture_frame {
+    unsigned char dir;       // First byte of the record: 1 = sent by Tx, 0 = by Rx
+    unsigned char data[CAPTURE_FRAME_MAX];
+    int len;
+    int inFrame;             // TRUE after an opening flag
+    uint64_t firstNsec;      // Slot time of the first byte
+    uint64_t lastNsec;       // Slot time of the last byte
+};
+
+// Sequence numbers in the control field of the frames of link_layer.c,
+// modulo 16 in the high nibble
+#define SEQ_MODULUS 16
+#define FRAME_NS(c) ((c) >> 4)
+#define FRAME_NR(c) ((c) >> 4)
+
+// Parameter of SET (type, length, value) giving the FCS of the I-frames:
+// 0 for the 1-byte BCC2 (also when absent), 1 for CRC-16, 2 for CRC-32
+#define TLV_FCS 0x03
+#define FRAME_HEAD_MAX 32    // Destuffed bytes kept of a frame: the header
+                             // and the parameters of SET
+
+// Link analyzer counters for one direction
+struct analyzer_dir {
+    unsigned long long bytes;
+    unsigned long long frames;
+    unsigned long long badFrames;        // Too short, or wrong BCC1
+    unsigned long long iFrames;
+    unsigned long long retransmissions;  // I-frames whose Ns was seen before
+    unsigned long long payload;          // Destuffed data of new I-frames
+    unsigned long long rr, rej, srej;    // Received in this direction
+    uint64_t iStart[SEQ_MODULUS];        // When each Ns was last sent
+    int iPending[SEQ_MODULUS];           // TRUE until acknowledged
+    int base, next;                      // I-frames sent and not acknowledged
+    struct histogram rtt;                // First byte of an I-frame to the end of its RR
+    unsigned long long lastBytes, lastPayload;  // At the previous CSV row
+};
+
+// Link analyzer, fed with the frames assembled by the capture thread
+struct analyzer {
+    pthread_mutex_t lock;    // Counters are read by the stats command
+    uint64_t startNsec;      // Link time when it was started
+    struct analyzer_dir dir[2];  // tx2rx and rx2tx
+    int fcsSize[2];          // Bytes of the FCS of the I-frames, from the last SET
+    FILE *csv;               // NULL if not dumping
+    uint64_t period;         // Between CSV rows, nsec
+    uint64_t nextDump;
+    uint64_t lastDump;
+};
+
+// Tap on the delivered bytes, feeding a pcap file, the analyzer or both
+struct capture {
+    FILE *file;              // NULL when not capturing to a file
+    struct analyzer *an;     // NULL when not analyzing
+    pthread_t thread;
+    atomic_int stop;
+    long long realtimeOffset;  // CLOCK_REALTIME - link time, in nsec
+    const struct cable_clock *clock;  // The link's, for the time of CSV rows
+    atomic_ulong baud[2];      // Of each direction, for the utilization
+    struct capture_ring tx2rx;
+    struct capture_ring rx2tx;
+    struct capture_frame tx2rxFrame;
+    struct capture_frame rx2txFrame;
+    unsigned long long frames;
+};
+
+// Drawn when there are no errors, large enough never to be reached
+#define NO_ERROR (1ULL << 62)
+
+// Flow control of the receive FIFOs
+#define FC_NONE 0          // Tail drop: bytes arriving at a full FIFO are lost
+#define FC_RTSCTS 1        // The sender stops while the FIFO is full
+#define FC_XONXOFF 2       // XOFF / XON sent back in-band
+#define XON 0x11
+#define XOFF 0x13
+
+// Frame-aware impairments. Bytes leaving a direction are split into
+// 0x7E-delimited frames, classified by their control field, and whole
+// frames can be dropped, duplicated or held back.
+#define FLAG 0x7E
+#define FRAME_MAX 4096     // Longer frames are passed or dropped, never copied
+#define FT_I 0
+#define FT_RR 1
+#define FT_REJ 2
+#define FT_SET 3
+#define FT_UA 4
+#define FT_DISC 5
+#define FT_SREJ 6
+#define FT_OTHER 7
+#define FT_ALL 0xFF        // Mask with every frame type
+#define FR_IDLE 0          // Between frames, bytes pass
+#define FR_HEAD 1          // Flag seen, waiting for the control field
+#define FR_BODY 2          // Rest of the frame, handled as decided
+#define FA_PASS 0
+#define FA_DROP 1
+#define FA_DUP 2
+#define FA_HOLD 3
+
+struct frame_rule {
+    double p;          // Probability per frame
+    unsigned types;    // Mask of the frame types (1 << FT_...) it applies to
+};
+
+struct framer {
+    int on;
+    struct frame_rule drop, dup, hold;
+    unsigned long holdDelay;   // usec a frame is held, 0 = until the next one passes
+    uint64_t rng[4];           // Separate from the bit errors, see seed_channels()
+    int state;                 // FR_IDLE, FR_HEAD or FR_BODY
+    int action;                // FA_..., decided once the control field is seen
+    unsigned char head[3];     // Flag, address and control, not yet delivered
+    int headLen;
+    unsigned char copy[FRAME_MAX];  // Frame being duplicated or held
+    int copyLen;
+    unsigned char held[FRAME_MAX];  // Frame waiting to be released
+    int heldLen;                    // 0 if none
+    uint64_t releaseNsec;           // Link time when it is released
+    unsigned long long frames, dropped, duplicated, heldBack;
+};
+
+// One direction of a link. Each direction has its own rate, propagation
+// delay and error model, so that asymmetric links can be emulated.
+struct direction {
+    const char *name;       // "TX2RX" or "RX2TX", for messages
+    double ber;      // Bit error rate
+    int burstOn;     // TRUE when the Gilbert-Elliott model replaces the BER
+    double burstBer[2];     // BER in the GOOD and BAD states
+    double burstSwitch[2];  // Probability per bit of leaving each state
+    double stateBer[2];     // BER in effect in each state
+    double logNoError[2];   // ln(1 - stateBer), for sampling error positions
+    double logStay[2];      // ln(1 - probability of leaving each state)
+    struct channel ch;
+    unsigned long baud;
+    unsigned long propDelay;   // Desired propagation delay in usec
+    int bufSize;    // Slots a byte spends in the ring buffer, for the propagation delay
+    long mask;      // Ring buffer entries minus 1, a power of two minus 1
+    char *ring;
+    char *valid;    // TRUE if corresponding entry holds a byte
+    uint32_t *senders;  // Bus mode: stations that sent each byte
+    uint64_t idx;   // Slots entered into the ring buffer, masked to index it
+    long batchSlots;   // Byte slots handled per wakeup (at least 1)
+    long inFlight;     // Valid bytes currently held in the ring buffer
+    struct timespec slotEpoch;  // Start of byte slot 0, in link time
+    long long slotCount;        // Next byte slot to handle, counted from slotEpoch
+    struct histogram lateness;  // Delivery time of each byte minus its slot time
+    struct framer fr;
+    int fifoDepth;     // Receive FIFO of the destination side, 0 = unlimited
+    int flowControl;   // FC_NONE, FC_RTSCTS or FC_XONXOFF
+    int xoff;          // TRUE after the destination side sent XOFF
+    int stopped;       // TRUE while the sender is held by an XOFF it received
+    char ctlPending;   // XON or XOFF to be sent in this direction, 0 if none
+    unsigned long long overruns, xoffs;
+    int fullWakeup;    // TRUE if the last wakeup delivered a byte in every slot
+    struct timespec lastFullWakeup;
+    unsigned long long loadBytes;  // Delivered between wakeups with every slot
+    long long loadNsec;            // used, and the time between them
+};
+
+// Bytes delivered to one side during a wakeup, written with one call
+struct output {
+    int fd;
+    int len;
+    int room;          // Free bytes in the receive FIFO, if it is limited
+    char buf[BUF_SIZE];
+};
+
+// Scenario: commands run at given link times or byte offsets, counted
+// from the first byte sent after the scenario was loaded
+#define MAX_SCENARIO_COMMAND 256
+
+struct scenario_event {
+    int atBytes;         // TRUE for a byte offset, FALSE for a time
+    uint64_t at;         // Bytes read from Tx, or nsec
+    int line;            // In the file, to keep its order among equal times
+    char command[MAX_SCENARIO_COMMAND];
+};
+
+struct scenario {
+    char name[BUF_SIZE];
+    struct scenario_event *timed;     // Sorted by time
+    struct scenario_event *counted;   // Sorted by byte offset
+    int nTimed, nCounted;
+    int nextTimed, nextCounted;
+    int started;                 // TRUE once the first byte was sent
+    uint64_t zero;               // Link time of the first slot, nsec
+    unsigned long long bytes;    // Read from Tx since the start
+};
+
 // Current running parameters
 struct parameters {
     int cableOn;
-    double byteER;   // Byte error rate
-    struct timespec byteDelay;
-    unsigned long propDelay;   // Desired propagation delay in usec
-    int bufSize;  // Dimensioned to enforce the propagation delay
-    char *tx2rx;  
-    char *tx2rxValid;  // TRUE if corresponding entry holds a byte
-    long tx2rxIdx;     // Input index for the tx2rx buffer
-    char *rx2tx;
-    char *rx2txValid;  // TRUE if corresponding entry holds a byte
-    long rx2txIdx;     // Input index for the tx2rx buffer
-    FILE *logfile;
+    unsigned long long seed;    // Seed of the error generators
+    struct direction tx2rx;
+    struct direction rx2tx;
+    unsigned long batchDelay;  // Desired interval between wakeups in usec
+    int virtualTime;            // TRUE to run the link's clock ahead while idle
+    unsigned long graceDelay;   // usec given to the endpoints before jumping ahead
+    long long clockOffset;      // Link time minus CLOCK_MONOTONIC, in nsec
+    struct cable_clock *clock;  // Published copy of clockOffset
+    struct timespec vtimeStartLink;  // When virtual time was turned on, link time
+    struct timespec vtimeStartWall;  // and CLOCK_MONOTONIC
+    int unreliableRate;         // TRUE once the warning was issued
+    int logIdle;                // TRUE once an idle period was logged
+    struct logger *log;         // NULL when not logging
+    struct capture *capture;  // NULL when neither capturing nor analyzing
+    struct scenario *scenario;  // NULL when none is loaded
+    unsigned long long busSent[MAX_STATIONS];  // Bytes sent by each station
+    unsigned long long collisions;             // Slots with several senders
+};
+
+// One emulated cable, between a transmitter port and a receiver port, or a
+// bus shared by a primary (the transmitter port) and several secondaries
+// (the receiver port and the extra ones).
+// Each link is served by one worker thread; commands from stdin run in the
+// main thread, so both hold "lock" while using the parameters.
+struct link {
+    int id;
+    char txDev[MAX_DEV_NAME];
+    char rxDev[MAX_DEV_NAME];
+    int fdTx, fdRx;          // Master sides of the pseudo-terminals
+    int slaveTx, slaveRx;    // Kept open, see openVirtualPort()
+    int nStations;           // 0 for a cable, ports on the bus otherwise
+    char busDev[MAX_STATIONS][MAX_DEV_NAME];  // From station 2 on
+    int busFd[MAX_STATIONS], busSlave[MAX_STATIONS];
+    int timerFd;
+    char clockFile[MAX_DEV_NAME + 32];
+    int active;              // TRUE while forwarding, FALSE while idle
+    int watching;            // TRUE while the ports are watched
+    int waitingGrace;        // TRUE while giving the endpoints time to react
+    int ready;               // Set by the worker when an event arrived
+    struct worker *worker;
+    int index;               // Position in the worker's list of links
+    pthread_mutex_t lock;
+    struct parameters par;
+};
+
+// Thread serving a share of the links, pinned to one CPU
+struct worker {
+    int id;
+    int cpu;
+    pthread_t thread;
+    int epfd;
+    int wakeFd;              // eventfd written to make the worker check "stopping"
+    struct link *links[MAX_LINKS];
+    int nLinks;
 };
 
-struct parameters par = {
+// What an epoll event refers to: kind in the low bits, link index above
+#define EV_TX 0
+#define EV_RX 1
+#define EV_TIMER 2
+#define EV_WAKE 3
+#define EV_KIND(data) ((data) & 3)
+#define EV_LINK(data) ((data) >> 2)
+#define EV_DATA(link, kind) (((uint64_t) (link) << 2) | (kind))
+
+struct link links[MAX_LINKS];
+int nLinks = 0;
+struct worker *workers = NULL;
+int nWorkers = 0;
+atomic_int stopping = FALSE;
+int selectedLink = 0;    // Link receiving the commands, -1 for all
+
+// Parameters of a newly created link
+const struct parameters defaultParameters = {
     .cableOn = TRUE,
-    .byteER = 0.0,
-    .propDelay = 0,
-    .tx2rx = NULL,
-    .tx2rxValid = NULL,
-    .rx2tx = NULL,
-    .rx2txValid = NULL,
-    .logfile = NULL
+    .tx2rx = { .name = "TX2RX", .batchSlots = 1 },
+    .rx2tx = { .name = "RX2TX", .batchSlots = 1 },
+    .batchDelay = 0,
+    .virtualTime = FALSE,
+    .graceDelay = DEFAULT_GRACE_DELAY,
+    .clockOffset = 0,
+    .log = NULL,
+    .capture = NULL,
+    .scenario = NULL
 };
 
 
 
-// Returns: serial port file descriptor (fd).
-int openSerialPort(const char *serialPort, struct termios *oldtio, struct termios *newtio)
+// Create a pseudo-terminal whose slave side is reachable through the
+// symbolic link "link", which is the port the transmitter or receiver opens.
+// The cable keeps the slave open itself ("slaveFd"), so that the master side
+// does not report a hangup while no program has the port open.
+// Returns: master side file descriptor (fd).
+int openVirtualPort(const char *link, int *slaveFd)
 {
-    int fd = open(serialPort, O_RDWR | O_NONBLOCK | O_NOCTTY);
+    int fd = posix_openpt(O_RDWR | O_NONBLOCK | O_NOCTTY);
 
     if (fd < 0)
         return -1;
 
-    // Save current port settings
-    if (tcgetattr(fd, oldtio) == -1)
+    if (grantpt(fd) == -1 || unlockpt(fd) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+
+    const char *slaveName = ptsname(fd);
+    *slaveFd = open(slaveName, O_RDWR | O_NONBLOCK | O_NOCTTY);
+    if (*slaveFd < 0)
+    {
+        close(fd);
         return -1;
+    }
 
-    memset(newtio, 0, sizeof(*newtio));
-    newtio->c_cflag = BAUDRATE | CS8 | CLOCAL | CREAD;
-    newtio->c_iflag = IGNPAR;
-    newtio->c_oflag = 0;
-    newtio->c_lflag = 0;
-    newtio->c_cc[VTIME] = 0; // Inter-character timer unused (polling mode)
-    newtio->c_cc[VMIN] = 0;  // Read without blocking
-    tcflush(fd, TCIOFLUSH);
+    // Raw mode without echo, like a serial line, until the program using
+    // the port sets its own attributes
+    struct termios tio;
+    if (tcgetattr(*slaveFd, &tio) == 0)
+    {
+        cfmakeraw(&tio);
+        tcsetattr(*slaveFd, TCSANOW, &tio);
+    }
+    chmod(slaveName, 0666);
 
-    if (tcsetattr(fd, TCSANOW, newtio) == -1)
+    // Replace a link left behind by a previous run, but never a real device
+    struct stat st;
+    if (lstat(link, &st) == 0 && S_ISLNK(st.st_mode))
+    {
+        unlink(link);
+    }
+    if (symlink(slaveName, link) == -1)
+    {
+        close(*slaveFd);
+        close(fd);
         return -1;
+    }
 
     return fd;
 }
 
 
+// Remove the link to a pseudo-terminal created by openVirtualPort()
+void closeVirtualPort(const char *link, int fd, int slaveFd)
+{
+    struct stat st;
+    if (lstat(link, &st) == 0 && S_ISLNK(st.st_mode))
+    {
+        unlink(link);
+    }
+    close(slaveFd);
+    close(fd);
+}
+
+
 // Add noise to a buffer, by flipping the byte in the "errorIndex" position.
 void addNoiseToBuffer(unsigned char *buf, size_t errorIndex)
 {
@@ -93,54 +480,285 @@ void addNoiseToBuffer(unsigned char *buf, size_t errorIndex)
 }
 
 
-// Initialize the ring buffers that implement the propagation delay
+// Natural logarithm of x > 0, without libm.
+// x = m * 2^e with m in [sqrt(2)/2, sqrt(2)), and ln(m) = 2 atanh((m-1)/(m+1)).
+double ln(double x)
+{
+    uint64_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    int e = (int) ((bits >> 52) & 0x7FF) - 1023;
+    bits = (bits & 0x000FFFFFFFFFFFFFULL) | 0x3FF0000000000000ULL;
+    double m;
+    memcpy(&m, &bits, sizeof(m));
+    if (m > 1.4142135623730951)
+    {
+        m /= 2;
+        ++e;
+    }
+    double z = (m - 1) / (m + 1), z2 = z * z, term = z, sum = 0;
+    for (int k = 1; k < 24; k += 2)
+    {
+        sum += term / k;
+        term *= z2;
+    }
+    return 2 * sum + e * 0.6931471805599453;
+}
+
+
+uint64_t rotl(uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+
+// xoshiro256** by Blackman and Vigna
+uint64_t rng_next(uint64_t s[4])
+{
+    uint64_t result = rotl(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+    return result;
+}
+
+
+// splitmix64, used to expand a seed into generator states
+uint64_t splitmix64(uint64_t *x)
+{
+    uint64_t z = (*x += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+
+// Number of failures before the first success, with ln(1 - p) given
+uint64_t geometric(struct channel *ch, double logFail)
+{
+    // Uniform in (0, 1]
+    double u = ((rng_next(ch->rng) >> 11) + 1) * 0x1.0p-53;
+    double n = ln(u) / logFail;
+    return n < NO_ERROR ? (uint64_t) n : NO_ERROR;
+}
+
+
+// Number of clean bits before the next error, at the BER of the current state
+uint64_t next_error(struct direction *d)
+{
+    if (d->stateBer[d->ch.state] == 0.0)
+    {
+        return NO_ERROR;
+    }
+    return geometric(&d->ch, d->logNoError[d->ch.state]);
+}
+
+
+// Number of bits sent before the channel leaves the current state (at least 1)
+uint64_t next_switch(struct direction *d)
+{
+    if (!d->burstOn || d->burstSwitch[d->ch.state] == 0.0)
+    {
+        return NO_ERROR;
+    }
+    return 1 + geometric(&d->ch, d->logStay[d->ch.state]);
+}
+
+
+// Flip the bits of a byte that are hit by errors, possibly more than one
+void add_noise(struct direction *d, char *byte)
+{
+    struct channel *ch = &d->ch;
+    if (ch->bitsToError >= 8 && ch->bitsToSwitch >= 8)
+    {
+        ch->bitsToError -= 8;
+        ch->bitsToSwitch -= 8;
+        return;
+    }
+
+    // Walk through the events falling inside this byte
+    uint64_t bit = 0;
+    while (TRUE)
+    {
+        if (ch->bitsToSwitch <= ch->bitsToError)
+        {
+            if (ch->bitsToSwitch >= 8 - bit)
+            {
+                break;
+            }
+            // The remaining bits are sent in the other state; both
+            // distributions are memoryless, so just draw again
+            bit += ch->bitsToSwitch;
+            ch->state = !ch->state;
+            ch->bitsToSwitch = next_switch(d);
+            ch->bitsToError = next_error(d);
+        }
+        else
+        {
+            if (ch->bitsToError >= 8 - bit)
+            {
+                break;
+            }
+            bit += ch->bitsToError;
+            *byte ^= (char) (1 << bit);
+            ++bit;
+            ch->bitsToSwitch -= ch->bitsToError + 1;
+            ch->bitsToError = next_error(d);
+        }
+    }
+    ch->bitsToError -= 8 - bit;
+    ch->bitsToSwitch -= 8 - bit;
+}
+
+
+// Restart a channel in the GOOD state after the error model changed
+void reset_channel(struct direction *d)
+{
+    d->ch.state = GOOD;
+    d->ch.bitsToSwitch = next_switch(d);
+    d->ch.bitsToError = next_error(d);
+}
+
+
+// Compute the per-state constants of the error model of a direction
+void set_error_model(struct direction *d)
+{
+    for (int state = GOOD; state <= BAD; ++state)
+    {
+        d->stateBer[state] = d->burstOn ? d->burstBer[state] : d->ber;
+        d->logNoError[state] = ln(1.0 - d->stateBer[state]);
+        if (d->burstOn && d->burstSwitch[state] > 0.0)
+        {
+            d->logStay[state] = d->burstSwitch[state] < 1.0 ? ln(1.0 - d->burstSwitch[state]) : -1.0e300;
+        }
+    }
+    reset_channel(d);
+}
+
+
+// Seed the error generators of both directions
+void seed_channels(struct parameters *par, unsigned long long seed)
+{
+    uint64_t x = seed;
+    for (int i = 0; i < 4; ++i)
+    {
+        par->tx2rx.ch.rng[i] = splitmix64(&x);
+    }
+    for (int i = 0; i < 4; ++i)
+    {
+        par->rx2tx.ch.rng[i] = splitmix64(&x);
+    }
+    // Frame impairments draw from their own generators, so that enabling
+    // them does not change which bits are hit
+    for (int i = 0; i < 4; ++i)
+    {
+        par->tx2rx.fr.rng[i] = splitmix64(&x);
+    }
+    for (int i = 0; i < 4; ++i)
+    {
+        par->rx2tx.fr.rng[i] = splitmix64(&x);
+    }
+    par->seed = seed;
+    reset_channel(&par->tx2rx);
+    reset_channel(&par->rx2tx);
+}
+
+
+// Start of a byte slot from the slot epoch, in nsec. Computed in whole
+// seconds of ten bits plus the remainder, so that the time of any slot is
+// exact to the nanosecond whatever the rate, and no rounding accumulates.
+uint64_t slot_offset(const struct direction *d, long long slot)
+{
+    return (slot / d->baud) * NSEC_PER_BYTE_BAUD + (slot % d->baud) * NSEC_PER_BYTE_BAUD / d->baud;
+}
+
+
+// Number of byte slots starting before "nsec" from the slot epoch
+long long slots_before(const struct direction *d, uint64_t nsec)
+{
+    uint64_t whole = nsec / NSEC_PER_BYTE_BAUD, rest = nsec % NSEC_PER_BYTE_BAUD;
+    return whole * d->baud + (rest * d->baud + NSEC_PER_BYTE_BAUD - 1) / NSEC_PER_BYTE_BAUD;
+}
+
+
+// Initialize the ring buffer that implements the propagation delay
 // Returns 0 on success, -1 on failure
-int init_ring_buffers(void)
+int init_ring_buffers(struct direction *d)
 {
-    long nsecPropDelay = 1000 * par.propDelay;
-    long bytesInFlight = nsecPropDelay / par.byteDelay.tv_nsec;
-    // Round instead of truncating
-    if (nsecPropDelay % par.byteDelay.tv_nsec > par.byteDelay.tv_nsec / 2)
+    // Rounded instead of truncated
+    long bytesInFlight = (d->propDelay * d->baud + NSEC_PER_BYTE_BAUD / 2000) / (NSEC_PER_BYTE_BAUD / 1000);
+    long actualPropDelay = slot_offset(d, bytesInFlight) / 1000; // usec
+    d->bufSize = bytesInFlight + 1;
+    // Power of two size, so that the entries are found with a mask
+    long size = 1;
+    while (size < d->bufSize)
     {
-        ++bytesInFlight;
+        size <<= 1;
     }
-    long actualPropDelay = bytesInFlight * par.byteDelay.tv_nsec / 1000; // usec
-    par.bufSize = bytesInFlight + 1;
-    par.tx2rx = realloc(par.tx2rx, par.bufSize);  
-    par.tx2rxValid = realloc(par.tx2rxValid, par.bufSize);
-    par.rx2tx = realloc(par.rx2tx, par.bufSize);
-    par.rx2txValid = realloc(par.rx2txValid, par.bufSize);
-    if (par.tx2rx == NULL || par.tx2rxValid == NULL || par.rx2tx == NULL || par.rx2txValid == NULL)
+    d->mask = size - 1;
+    d->ring = realloc(d->ring, size);
+    d->valid = realloc(d->valid, size);
+    d->senders = realloc(d->senders, size * sizeof(*d->senders));
+    if (d->ring == NULL || d->valid == NULL || d->senders == NULL)
     {
         return -1;
     }
-    bzero(par.tx2rxValid, par.bufSize);
-    bzero(par.rx2txValid, par.bufSize);
-    par.tx2rxIdx = 0;
-    par.rx2txIdx = 0;
-    printf("PROPAGATION DELAY SET TO %ld usec (DESIRED = %lu usec)\n", actualPropDelay, par.propDelay);
+    bzero(d->valid, size);
+    d->idx = 0;
+    d->inFlight = 0;
+    printf("%s PROPAGATION DELAY SET TO %ld usec (DESIRED = %lu usec)\n",
+           d->name, actualPropDelay, d->propDelay);
     return 0;
 }
 
 
-// Set the byte delay corresponding to the selected baud rate
-void set_baud_rate(unsigned long baud)
+// Ring buffer entry of the byte leaving the ring "k" slots from now. The
+// byte entering it in a slot leaves bufSize - 1 slots later.
+long ring_out(const struct direction *d, long k)
+{
+    return (d->idx + k + 1 - d->bufSize) & d->mask;
+}
+
+
+struct timespec slot_time(struct direction *d, long long slot);
+
+
+// Compute how many byte slots of a direction are handled per wakeup in
+// batched mode
+void init_batch(struct parameters *par, struct direction *d)
 {
-    // 10 bit times per byte; delay in nanoseconds
-    double delay = 1.0e10 / baud;
-    par.byteDelay.tv_sec = 0;
-    par.byteDelay.tv_nsec = (long) delay;
-    printf("BAUD RATE: %lu\n", baud);
-    init_ring_buffers();
+    d->batchSlots = par->batchDelay * d->baud / (NSEC_PER_BYTE_BAUD / 1000);
+    if (d->batchSlots < 1)
+    {
+        d->batchSlots = 1;
+    }
+    if (d->batchSlots > BUF_SIZE)
+    {
+        d->batchSlots = BUF_SIZE;
+    }
 }
 
 
-// Make the program use RT priority to improve precision in timing
-void set_rt_priority(void) {
-    struct sched_param sp = { .sched_priority = 50 };
-    if (sched_setscheduler(0, SCHED_FIFO, &sp) == -1) {
-      perror("Could not set realtime priority");
+// Set the byte delay of a direction corresponding to the selected baud rate
+void set_baud_rate(struct parameters *par, struct direction *d, unsigned long baud)
+{
+    // Keep the slots already handled at the old rate
+    if (d->baud > 0)
+    {
+        d->slotEpoch = slot_time(d, d->slotCount);
+    }
+    d->slotCount = 0;
+    d->baud = baud;
+    if (par->capture != NULL)
+    {
+        atomic_store(&par->capture->baud[d == &par->tx2rx ? 0 : 1], baud);
     }
+    printf("%s BAUD RATE: %lu\n", d->name, baud);
+    init_ring_buffers(d);
+    init_batch(par, d);
 }
 
 
@@ -200,361 +818,2987 @@ int timespec_is_negative(const struct timespec *t)
 }
 
 
-void endlog(void)
+long long timespec_to_nsec(const struct timespec *t)
 {
-    if (par.logfile != NULL)
-    {
-        fclose(par.logfile);
-        par.logfile = NULL;
-    }
+    return (long long) t->tv_sec * 1000000000 + t->tv_nsec;
 }
 
 
-void startlog(const char *filename)
+// Start time of a byte slot. Computed from the epoch rather than by adding
+// byte delays one after the other, so that errors do not accumulate.
+struct timespec slot_time(struct direction *d, long long slot)
 {
-    endlog();
-    par.logfile = fopen(filename, "w");
-    if (par.logfile != NULL)
-    {
-        fprintf(par.logfile, "Tx->Rx | Rx->Tx\n");
-        printf("LOGGING TO FILE %s\n", filename);
-    }
-    else
-    {
-        printf("ERROR OPENING FILE %s, NOT LOGGING\n", filename);
-    }
+    uint64_t nsec = slot_offset(d, slot);
+    struct timespec offset = { .tv_sec = nsec / 1000000000,
+                               .tv_nsec = nsec % 1000000000 };
+    return timespec_sum(&d->slotEpoch, &offset);
 }
 
 
-// Show help
-void help()
+// Current time on a link: CLOCK_MONOTONIC, plus however far virtual time
+// has moved the link ahead
+void link_now(struct parameters *par, struct timespec *t)
 {
-    printf("\n\n"
-           "Transmitter must open " TXDEV "\n"
-           "Receiver must open " RXDEV "\n"
-           "\n"
-           "The cable program is sensible to the following interactive commands:\n"
-           "--- help         : show this help\n"
-           "--- on           : connect the cable and data is exchanged (default state)\n"
-           "--- off          : disconnect the cable disabling data to be exchanged\n"
-           "--- ber <ber>    : add noise to data bits at a specified BER (default=0)\n"
-           "--- baud <rate>  : set baud rate, between 1200 and 115200 (default=9600)\n"
-           "                   note that 10 bits are sent per byte (8-N-1)\n"
-           "--- prop <delay> : set the propagation delay in usec (0-1000000, default=0)\n"
-           "                   will be approximated to an integer multiple of the byte\n"
-           "                   delay (10 / baud_rate)\n"
-           "--- log <file>   : log transmitted data to file\n"
-           "--- endlog       : stop logging transmitted data\n"
-           "--- quit         : terminate the program\n\n"
-           "IMPORTANT: Changing de baud rate or propagation delay while a transmission is\n"
-           "           ongoing will result in losses.\n"
-           "\n");
+    clock_gettime(CLOCK_MONOTONIC, t);
+    struct timespec offset = { .tv_sec = par->clockOffset / 1000000000,
+                               .tv_nsec = par->clockOffset % 1000000000 };
+    *t = timespec_sum(t, &offset);
 }
 
-int main(int argc, char *argv[])
+
+// Move the link's clock forward to "target", if it is in the future
+void advance_clock(struct parameters *par, const struct timespec *target)
 {
-    printf("\n");
+    struct timespec now;
+    link_now(par, &now);
+    struct timespec ahead = timespec_diff(target, &now);
+    if (timespec_is_negative(&ahead))
+    {
+        return;
+    }
+    par->clockOffset += timespec_to_nsec(&ahead);
+    __atomic_store_n(&par->clock->offset, par->clockOffset, __ATOMIC_RELEASE);
+}
 
-    system("socat -dd PTY,link=" TXDEV ",mode=777,raw,echo=0 PTY,link=/dev/emulatorTx,mode=777,raw,echo=0 &");
-    sleep(1);
-    printf("\n");
 
-    system("socat -dd PTY,link=" RXDEV ",mode=777,raw,echo=0 PTY,link=/dev/emulatorRx,mode=777,raw,echo=0 &");
-    sleep(1);
+// Number of byte slots that are due at link time "now", starting with the
+// next one. Limited to BUF_SIZE slots per wakeup.
+long slots_due(struct direction *d, const struct timespec *now)
+{
+    struct timespec elapsed = timespec_diff(now, &d->slotEpoch);
+    if (timespec_is_negative(&elapsed))
+    {
+        return 0;
+    }
+    long long slots = slots_before(d, timespec_to_nsec(&elapsed) + 1) - d->slotCount;
+    return slots < 0 ? 0 : slots > BUF_SIZE ? BUF_SIZE : (long) slots;
+}
 
-    help();
 
-    // Configure serial ports
-    struct termios oldtioTx;
-    struct termios newtioTx;
+// Number of byte slots, starting with the next one, that begin before the
+// link time "limit" in nsec
+long long slots_until(struct direction *d, uint64_t limit)
+{
+    uint64_t epoch = timespec_to_nsec(&d->slotEpoch);
+    long long slots = limit > epoch ? slots_before(d, limit - epoch) - d->slotCount : 0;
+    return slots < 0 ? 0 : slots;
+}
 
-    int fdTx = openSerialPort("/dev/emulatorTx", &oldtioTx, &newtioTx);
 
-    if (fdTx < 0)
+// Delivered throughput under load: measured only between wakeups that
+// delivered a byte in every slot, when the rate of the cable alone limits
+// the traffic
+void measure_load(struct direction *d, long slots, long delivered, const struct timespec *now)
+{
+    int full = slots > 0 && delivered == slots;
+    if (full && d->fullWakeup)
     {
-        perror("Opening Tx emulator serial port");
-        exit(-1);
+        struct timespec gap = timespec_diff(now, &d->lastFullWakeup);
+        d->loadNsec += timespec_to_nsec(&gap);
+        d->loadBytes += delivered;
     }
+    d->fullWakeup = full;
+    d->lastFullWakeup = *now;
+}
+
 
-    struct termios oldtioRx;
-    struct termios newtioRx;
+// Time at which the last slot of the next batch of either direction is due.
+// A bus only uses tx2rx.
+struct timespec next_batch(struct link *link)
+{
+    struct parameters *par = &link->par;
+    struct timespec tx2rx = slot_time(&par->tx2rx, par->tx2rx.slotCount + par->tx2rx.batchSlots - 1);
+    struct timespec rx2tx = slot_time(&par->rx2tx, par->rx2tx.slotCount + par->rx2tx.batchSlots - 1);
+    return link->nStations > 0 || timespec_comp(&tx2rx, &rx2tx) <= 0 ? tx2rx : rx2tx;
+}
 
-    int fdRx = openSerialPort("/dev/emulatorRx", &oldtioRx, &newtioRx);
 
-    if (fdRx < 0)
+void histogram_add(struct histogram *h, long long nsec, unsigned long long n)
+{
+    long long usec = nsec > 0 ? nsec / 1000 : 0;
+    int bucket;
+    if (usec < HIST_LINEAR)
     {
-        perror("Opening Rx emulator serial port");
-        exit(-1);
+        bucket = usec;
     }
+    else
+    {
+        // HIST_LINEAR is 2^10
+        bucket = HIST_LINEAR + 63 - __builtin_clzll(usec) - 10;
+        if (bucket >= HIST_LINEAR + HIST_LOG)
+        {
+            bucket = HIST_LINEAR + HIST_LOG - 1;
+        }
+    }
+    h->count[bucket] += n;
+    h->total += n;
+    if (nsec > h->max)
+    {
+        h->max = nsec;
+    }
+}
 
-    // Configure stdin to receive commands to this program
-    int oldf = fcntl(STDIN_FILENO, F_GETFL, 0);
-    fcntl(STDIN_FILENO, F_SETFL, oldf | O_NONBLOCK);
-
-    char rxStdin[BUF_SIZE] = {0};
 
-    int STOP = FALSE;
+// Upper bound, in usec, of the bucket holding the given fraction of samples
+long long histogram_percentile(const struct histogram *h, double fraction)
+{
+    unsigned long long target = (unsigned long long) (fraction * h->total);
+    unsigned long long seen = 0;
+    for (int i = 0; i < HIST_LINEAR + HIST_LOG; ++i)
+    {
+        seen += h->count[i];
+        if (seen > target)
+        {
+            long long bound = i < HIST_LINEAR ? i + 1 : 1LL << (i - HIST_LINEAR + 11);
+            // The coarse buckets can go past the largest value seen
+            return bound < h->max / 1000 + 1 ? bound : h->max / 1000 + 1;
+        }
+    }
+    return h->max / 1000;
+}
 
-    set_baud_rate(DEFAULT_BAUDRATE);
 
-    set_rt_priority();
+// Push one record into the log ring (forwarding loop side)
+void log_push(struct logger *log, const struct log_record *rec)
+{
+    uint64_t head = atomic_load_explicit(&log->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&log->tail, memory_order_acquire);
+    if (head - tail == LOG_SIZE)
+    {
+        ++log->lost;
+        return;
+    }
+    log->rec[head & (LOG_SIZE - 1)] = *rec;
+    atomic_store_explicit(&log->head, head + 1, memory_order_release);
+}
 
-    // For logging
-    char tx2rxTx[3], tx2rxRx[3], rx2txTx[3], rx2txRx[3];
-    int cableIdle = FALSE;
 
-    printf("\nCable ready\n\n");
+// Log one slot; of a run of empty slots, only the first is recorded
+void log_slot(struct parameters *par, const struct log_record *rec)
+{
+    if ((rec->flags & ~LOG_BUS) == 0)
+    {
+        if (par->logIdle == FALSE)
+        {
+            log_push(par->log, rec);
+            par->logIdle = TRUE;
+        }
+        return;
+    }
+    log_push(par->log, rec);
+    par->logIdle = FALSE;
+}
 
-    // To compensate for deviations in byte transmission time
-    struct timespec currentTime, nextTxTime, timeDiff, nextWait;
-    int skipWait = FALSE;
-    int unreliableRate = FALSE;
-    clock_gettime(CLOCK_MONOTONIC, &nextTxTime);
 
-    while (STOP == FALSE)
+// Write the records in the log ring (log thread side)
+void log_drain(struct logger *log)
+{
+    uint64_t tail = atomic_load_explicit(&log->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&log->head, memory_order_acquire);
+    for (; tail != head; ++tail)
     {
-        // Check how much waiting time we should have (if any)
-        clock_gettime(CLOCK_MONOTONIC, &currentTime);
-        timeDiff = timespec_diff(&currentTime, &nextTxTime);
-        nextTxTime = timespec_sum(&nextTxTime, &par.byteDelay);
-        if (timeDiff.tv_sec >= 1)
+        const struct log_record *rec = &log->rec[tail & (LOG_SIZE - 1)];
+        if (rec->flags & LOG_CABLE_OFF)
+        {
+            fputs("CABLE OFF\n", log->file);
+            continue;
+        }
+        if ((rec->flags & ~LOG_BUS) == 0)
+        {
+            fputs("---------------\n", log->file);
+            continue;
+        }
+        char text[4][3];
+        for (int k = 0; k < 4; ++k)
         {
-            if (unreliableRate == FALSE)
+            if (rec->flags & (1 << k))
             {
-                printf("UNRELIABLE RATE: Could not keep up, timeDiff exceeded 1s\n"
-                       "No further warnings will be issued\n");
-                unreliableRate = TRUE;
+                sprintf(text[k], "%02hhX", rec->byte[k]);
+            }
+            else
+            {
+                memcpy(text[k], "  ", 3);
             }
         }
-        nextWait = timespec_diff(&nextTxTime, &currentTime);
-        if (timespec_is_negative(&nextWait))
+        if (rec->flags & LOG_BUS)
         {
-            skipWait = TRUE;
+            fprintf(log->file, "%s  %s |       \n", text[0], text[1]);
         }
         else
         {
-            skipWait = FALSE;
+            fprintf(log->file, "%s  %s | %s  %s\n", text[0], text[1], text[2], text[3]);
         }
+    }
+    atomic_store_explicit(&log->tail, tail, memory_order_release);
+}
 
-        // Read from Tx
-        int bytesFromTx = read(fdTx, par.tx2rx + par.tx2rxIdx, 1);
-        par.tx2rxValid[par.tx2rxIdx] = bytesFromTx > 0;
 
-        // Read from Rx
-        int bytesFromRx = read(fdRx, par.rx2tx + par.rx2txIdx, 1);
-        par.rx2txValid[par.rx2txIdx] = bytesFromRx > 0;
+// Log thread: write the log every few milliseconds until stopped
+void *log_thread(void *arg)
+{
+    struct logger *log = arg;
+    const struct timespec period = { .tv_sec = 0, .tv_nsec = 20000000 };
+    while (!atomic_load(&log->stop))
+    {
+        nanosleep(&period, NULL);
+        log_drain(log);
+    }
+    log_drain(log);
+    return NULL;
+}
 
-        if (!par.cableOn)
-        {
-            // Ignore what was read
-            par.tx2rxValid[par.tx2rxIdx] = 0;
-            par.rx2txValid[par.rx2txIdx] = 0;
-        }
 
-        if (par.logfile != NULL)  // Currently logging
-        {
-            if (par.tx2rxValid[par.tx2rxIdx])
-            {
-                sprintf(tx2rxTx, "%02hhX", par.tx2rx[par.tx2rxIdx]);
-            }
-            else
-            {
-                memcpy(tx2rxTx, "  ", 3);
+void endlog(struct parameters *par)
+{
+    struct logger *log = par->log;
+    if (log == NULL)
+    {
+        return;
+    }
+    atomic_store(&log->stop, TRUE);
+    pthread_join(log->thread, NULL);
+    fclose(log->file);
+    if (log->lost > 0)
+    {
+        printf("LOG ENDED: %llu SLOTS NOT LOGGED\n", log->lost);
+    }
+    par->log = NULL;
+    free(log);
+}
+
+
+void startlog(struct parameters *par, const char *filename)
+{
+    endlog(par);
+    struct logger *log = calloc(1, sizeof(*log));
+    if (log == NULL)
+    {
+        printf("OUT OF MEMORY, NOT LOGGING\n");
+        return;
+    }
+    log->file = fopen(filename, "w");
+    if (log->file == NULL)
+    {
+        printf("ERROR OPENING FILE %s, NOT LOGGING\n", filename);
+        free(log);
+        return;
+    }
+    fprintf(log->file, "Tx->Rx | Rx->Tx\n");
+    if (pthread_create(&log->thread, NULL, log_thread, log) != 0)
+    {
+        printf("ERROR STARTING LOG THREAD, NOT LOGGING\n");
+        fclose(log->file);
+        free(log);
+        return;
+    }
+    par->log = log;
+    par->logIdle = FALSE;
+    printf("LOGGING TO FILE %s\n", filename);
+}
+
+
+// Push one delivered byte into a capture ring (forwarding loop side)
+void capture_push(struct capture_ring *ring, uint64_t nsec, unsigned char byte)
+{
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail == CAPTURE_SIZE)
+    {
+        ++ring->lost;
+        return;
+    }
+    ring->rec[head & (CAPTURE_SIZE - 1)] = (struct capture_record) { nsec, byte };
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+
+void analyze_frame(struct analyzer *an, const struct capture_frame *frame);
+
+
+// Pass the frame assembled so far to the pcap file and the analyzer
+void capture_write_frame(struct capture *cap, struct capture_frame *frame, uint64_t nsec)
+{
+    if (frame->len == 0)
+    {
+        return;
+    }
+    if (cap->file != NULL)
+    {
+        long long t = nsec + cap->realtimeOffset;
+        uint32_t header[4] = { t / 1000000000, t % 1000000000 / 1000,
+                               frame->len + 1, frame->len + 1 };
+        fwrite(header, sizeof(header), 1, cap->file);
+        fputc(frame->dir, cap->file);
+        fwrite(frame->data, 1, frame->len, cap->file);
+        ++cap->frames;
+    }
+    if (cap->an != NULL)
+    {
+        analyze_frame(cap->an, frame);
+    }
+    frame->len = 0;
+}
+
+
+// Split the byte stream of one direction into frames delimited by 0x7E.
+// Flags are kept so the records hold the bytes exactly as sent; bytes
+// outside frames get records of their own.
+void capture_byte(struct capture *cap, struct capture_frame *frame, const struct capture_record *rec)
+{
+    if (cap->an != NULL)
+    {
+        ++cap->an->dir[frame->dir ? 0 : 1].bytes;
+    }
+    frame->lastNsec = rec->nsec;
+    if (rec->byte == 0x7E)
+    {
+        if (frame->inFrame && frame->len > 1)
+        {
+            // Closing flag
+            frame->data[frame->len++] = rec->byte;
+            capture_write_frame(cap, frame, rec->nsec);
+            frame->inFrame = FALSE;
+            return;
+        }
+        if (!frame->inFrame)
+        {
+            capture_write_frame(cap, frame, rec->nsec);
+        }
+        // Opening flag (a repeated flag restarts the frame)
+        frame->len = 0;
+        frame->inFrame = TRUE;
+    }
+    if (frame->len == 0)
+    {
+        frame->firstNsec = rec->nsec;
+    }
+    frame->data[frame->len++] = rec->byte;
+    if (frame->len == CAPTURE_FRAME_MAX)
+    {
+        capture_write_frame(cap, frame, rec->nsec);
+    }
+}
+
+
+// Move the records available in both rings to the consumers, in time order
+void capture_drain(struct capture *cap)
+{
+    uint64_t txHead = atomic_load_explicit(&cap->tx2rx.head, memory_order_acquire);
+    uint64_t rxHead = atomic_load_explicit(&cap->rx2tx.head, memory_order_acquire);
+    uint64_t txTail = atomic_load_explicit(&cap->tx2rx.tail, memory_order_relaxed);
+    uint64_t rxTail = atomic_load_explicit(&cap->rx2tx.tail, memory_order_relaxed);
+
+    if (cap->an != NULL)
+    {
+        pthread_mutex_lock(&cap->an->lock);
+    }
+    while (txTail != txHead || rxTail != rxHead)
+    {
+        const struct capture_record *tx = &cap->tx2rx.rec[txTail & (CAPTURE_SIZE - 1)];
+        const struct capture_record *rx = &cap->rx2tx.rec[rxTail & (CAPTURE_SIZE - 1)];
+        if (rxTail == rxHead || (txTail != txHead && tx->nsec <= rx->nsec))
+        {
+            capture_byte(cap, &cap->tx2rxFrame, tx);
+            ++txTail;
+        }
+        else
+        {
+            capture_byte(cap, &cap->rx2txFrame, rx);
+            ++rxTail;
+        }
+    }
+    if (cap->an != NULL)
+    {
+        pthread_mutex_unlock(&cap->an->lock);
+    }
+    atomic_store_explicit(&cap->tx2rx.tail, txTail, memory_order_release);
+    atomic_store_explicit(&cap->rx2tx.tail, rxTail, memory_order_release);
+}
+
+
+void analyze_dump(struct capture *cap, uint64_t nsec);
+
+
+// Capture thread: drain the rings every few milliseconds until stopped
+void *capture_thread(void *arg)
+{
+    struct capture *cap = arg;
+    const struct timespec period = { .tv_sec = 0, .tv_nsec = 20000000 };
+    while (!atomic_load(&cap->stop))
+    {
+        nanosleep(&period, NULL);
+        capture_drain(cap);
+        if (cap->an != NULL && cap->an->csv != NULL)
+        {
+            // Link time, as cable_clock_gettime() gives it to the endpoints
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            uint64_t nsec = timespec_to_nsec(&now) + __atomic_load_n(&cap->clock->offset, __ATOMIC_ACQUIRE);
+            if (nsec >= cap->an->nextDump)
+            {
+                analyze_dump(cap, nsec);
+            }
+        }
+    }
+    capture_drain(cap);
+    return NULL;
+}
+
+
+// The consumers of the capture thread are only changed while it is stopped
+void capture_pause(struct capture *cap)
+{
+    atomic_store(&cap->stop, TRUE);
+    pthread_join(cap->thread, NULL);
+    atomic_store(&cap->stop, FALSE);
+}
+
+
+// Restart the capture thread, or get rid of the tap if nothing consumes it.
+// Returns 0 on success, -1 on failure.
+int capture_resume(struct parameters *par)
+{
+    struct capture *cap = par->capture;
+    if (cap->file == NULL && cap->an == NULL)
+    {
+        // Incomplete frames are flushed as they are
+        par->capture = NULL;
+        free(cap);
+        return 0;
+    }
+    if (pthread_create(&cap->thread, NULL, capture_thread, cap) != 0)
+    {
+        par->capture = NULL;
+        free(cap);
+        return -1;
+    }
+    return 0;
+}
+
+
+// Get the tap of a link with its thread stopped, creating it if needed
+struct capture *capture_open(struct parameters *par)
+{
+    struct capture *cap = par->capture;
+    if (cap != NULL)
+    {
+        capture_pause(cap);
+        return cap;
+    }
+    cap = calloc(1, sizeof(*cap));
+    if (cap == NULL)
+    {
+        return NULL;
+    }
+    struct timespec mono, real;
+    link_now(par, &mono);
+    clock_gettime(CLOCK_REALTIME, &real);
+    cap->realtimeOffset = timespec_to_nsec(&real) - timespec_to_nsec(&mono);
+    cap->clock = par->clock;
+    atomic_store(&cap->baud[0], par->tx2rx.baud);
+    atomic_store(&cap->baud[1], par->rx2tx.baud);
+    cap->tx2rxFrame.dir = 1;
+    cap->rx2txFrame.dir = 0;
+    par->capture = cap;
+    return cap;
+}
+
+
+void endcapture(struct parameters *par)
+{
+    struct capture *cap = par->capture;
+    if (cap == NULL || cap->file == NULL)
+    {
+        return;
+    }
+    capture_pause(cap);
+    if (cap->an == NULL)
+    {
+        // Incomplete frames are written as they are
+        capture_write_frame(cap, &cap->tx2rxFrame, cap->tx2rxFrame.lastNsec);
+        capture_write_frame(cap, &cap->rx2txFrame, cap->rx2txFrame.lastNsec);
+    }
+    fclose(cap->file);
+    cap->file = NULL;
+    printf("CAPTURE ENDED: %llu FRAMES, %llu BYTES LOST\n", cap->frames, cap->tx2rx.lost + cap->rx2tx.lost);
+    capture_resume(par);
+}
+
+
+void startcapture(struct parameters *par, const char *filename)
+{
+    endcapture(par);
+    FILE *file = fopen(filename, "wb");
+    if (file == NULL)
+    {
+        printf("ERROR OPENING FILE %s, NOT CAPTURING\n", filename);
+        return;
+    }
+    struct capture *cap = capture_open(par);
+    if (cap == NULL)
+    {
+        printf("OUT OF MEMORY, NOT CAPTURING\n");
+        fclose(file);
+        return;
+    }
+
+    // pcap global header: magic, version 2.4, GMT offset, accuracy,
+    // snapshot length and link type
+    uint32_t header[6] = { 0xA1B2C3D4, 2 | (4 << 16), 0, 0, CAPTURE_FRAME_MAX + 1, LINKTYPE_USER0 };
+    fwrite(header, sizeof(header), 1, file);
+    cap->file = file;
+    cap->frames = 0;
+
+    if (capture_resume(par) < 0)
+    {
+        printf("ERROR STARTING CAPTURE THREAD, NOT CAPTURING\n");
+        fclose(file);
+        return;
+    }
+    printf("CAPTURING TO FILE %s\n", filename);
+}
+
+
+// Queue a delivered byte for one side, and for the capture
+void deliver(struct parameters *par, int dir, struct output *out, unsigned char byte, uint64_t nsec)
+{
+    struct direction *d = dir == 0 ? &par->tx2rx : &par->rx2tx;
+    if (d->fifoDepth > 0)
+    {
+        if (out->room <= 0)
+        {
+            // Overrun: the receiving UART has nowhere to put it
+            ++d->overruns;
+            return;
+        }
+        --out->room;
+    }
+    if (out->len == BUF_SIZE)
+    {
+        write(out->fd, out->buf, out->len);
+        out->len = 0;
+    }
+    out->buf[out->len++] = byte;
+    if (par->capture != NULL)
+    {
+        capture_push(dir == 0 ? &par->capture->tx2rx : &par->capture->rx2tx, nsec, byte);
+    }
+}
+
+
+void deliver_frame(struct parameters *par, int dir, struct output *out,
+                   const unsigned char *frame, int len, uint64_t nsec)
+{
+    for (int i = 0; i < len; ++i)
+    {
+        deliver(par, dir, out, frame[i], nsec);
+    }
+}
+
+
+// Type of a frame, from its control field
+int frame_type(unsigned char control)
+{
+    switch (control & 0x0F)
+    {
+        case 0x00:
+            return FT_I;
+        case 0x05:
+            return FT_RR;
+        case 0x01:
+            return FT_REJ;
+        case 0x03:
+            return FT_SET;
+        case 0x07:
+            return FT_UA;
+        case 0x0B:
+            return FT_DISC;
+        case 0x0D:
+            return FT_SREJ;
+        default:
+            return FT_OTHER;
+    }
+}
+
+
+// Bytes of the FCS of the I-frames asked for by a SET of "n" destuffed
+// bytes (BCC2 included), of which the first "kept" are in "set"
+int set_fcs_size(const unsigned char *set, int n, int kept)
+{
+    int end = n - 1 < kept ? n - 1 : kept;
+    int fcs = 0;
+    for (int i = 3; i + 2 <= end && i + 2 + set[i + 1] <= end; i += 2 + set[i + 1])
+    {
+        if (set[i] == TLV_FCS)
+        {
+            // Big-endian value
+            fcs = 0;
+            for (int k = 0; k < set[i + 1]; ++k)
+            {
+                fcs = fcs << 8 | set[i + 2 + k];
+            }
+        }
+    }
+    return fcs == 2 ? 4 : fcs == 1 ? 2 : 1;
+}
+
+
+// RR and REJ acknowledge the I-frames sent the other way, from the base up
+// to Nr, which must be one of those in flight or the next one
+void acknowledge_frames(struct analyzer_dir *ad, int nr)
+{
+    if ((nr - ad->base + SEQ_MODULUS) % SEQ_MODULUS > (ad->next - ad->base + SEQ_MODULUS) % SEQ_MODULUS)
+    {
+        return;
+    }
+    for (; ad->base != nr; ad->base = (ad->base + 1) % SEQ_MODULUS)
+    {
+        ad->iPending[ad->base] = FALSE;
+    }
+}
+
+
+// Update the analyzer counters with a frame delivered in one direction.
+// Frames are destuffed on the fly (0x7D escapes the next byte, XORed with
+// 0x20) to find their header and payload size.
+void analyze_frame(struct analyzer *an, const struct capture_frame *frame)
+{
+    int dir = frame->dir ? 0 : 1;
+    struct analyzer_dir *ad = &an->dir[dir], *back = &an->dir[!dir];
+    if (frame->len < 2 || frame->data[0] != FLAG || frame->data[frame->len - 1] != FLAG)
+    {
+        // Bytes outside frames
+        return;
+    }
+
+    unsigned char head[FRAME_HEAD_MAX];
+    int n = 0;
+    for (int i = 1; i < frame->len - 1; ++i)
+    {
+        unsigned char byte = frame->data[i];
+        if (byte == 0x7D && i + 1 < frame->len - 1)
+        {
+            byte = frame->data[++i] ^ 0x20;
+        }
+        if (n < FRAME_HEAD_MAX)
+        {
+            head[n] = byte;
+        }
+        ++n;
+    }
+    ++ad->frames;
+    if (n < 3 || (head[0] ^ head[1]) != head[2])
+    {
+        ++ad->badFrames;
+        return;
+    }
+
+    unsigned char c = head[1];
+    switch (frame_type(c))
+    {
+        case FT_I:
+        {
+            if (n < 3 + an->fcsSize[dir])
+            {
+                ++ad->badFrames;
+                return;
+            }
+            int ns = FRAME_NS(c);
+            ++ad->iFrames;
+            // Sent again while waiting for its RR: after a timeout, a
+            // REJ (the frames from Nr on) or a SREJ (that frame only)
+            if (ad->iPending[ns])
+            {
+                ++ad->retransmissions;
+            }
+            else
+            {
+                ad->payload += n - 3 - an->fcsSize[dir];  // Header and FCS
+                ad->next = (ns + 1) % SEQ_MODULUS;
+            }
+            ad->iStart[ns] = frame->firstNsec;
+            ad->iPending[ns] = TRUE;
+            break;
+        }
+        case FT_RR:
+        {
+            // The round trip is measured for the last I-frame acknowledged
+            int ns = (FRAME_NR(c) + SEQ_MODULUS - 1) % SEQ_MODULUS;
+            ++ad->rr;
+            if (back->iPending[ns])
+            {
+                histogram_add(&back->rtt, frame->lastNsec - back->iStart[ns], 1);
+            }
+            acknowledge_frames(back, FRAME_NR(c));
+            break;
+        }
+        case FT_REJ:
+            ++ad->rej;
+            acknowledge_frames(back, FRAME_NR(c));
+            break;
+        case FT_SET:
+            an->fcsSize[dir] = set_fcs_size(head, n, FRAME_HEAD_MAX);
+            break;
+        case FT_SREJ:
+            ++ad->srej;
+            break;
+    }
+}
+
+
+// Append a CSV row with the counters and the rates since the previous row
+void analyze_dump(struct capture *cap, uint64_t nsec)
+{
+    struct analyzer *an = cap->an;
+    double elapsed = (nsec - an->startNsec) / 1e9;
+    double period = (nsec - an->lastDump) / 1e9;
+    pthread_mutex_lock(&an->lock);
+    fprintf(an->csv, "%.3lf", elapsed);
+    for (int i = 0; i < 2; ++i)
+    {
+        struct analyzer_dir *ad = &an->dir[i];
+        double goodput = period > 0 ? (ad->payload - ad->lastPayload) / period : 0.0;
+        double utilization = period > 0 ? (ad->bytes - ad->lastBytes) * 10.0 / (period * atomic_load(&cap->baud[i])) : 0.0;
+        fprintf(an->csv, ",%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%.1lf,%.4lf,%lld",
+                ad->bytes, ad->frames, ad->badFrames, ad->iFrames, ad->retransmissions,
+                ad->rr, ad->rej, ad->srej, goodput, utilization,
+                ad->rtt.total > 0 ? histogram_percentile(&ad->rtt, 0.50) : 0);
+        ad->lastBytes = ad->bytes;
+        ad->lastPayload = ad->payload;
+    }
+    fputc('\n', an->csv);
+    fflush(an->csv);
+    pthread_mutex_unlock(&an->lock);
+    an->lastDump = nsec;
+    an->nextDump += an->period;
+    if (an->nextDump <= nsec)
+    {
+        an->nextDump = nsec + an->period;
+    }
+}
+
+
+void reset_analyzer(struct analyzer *an, uint64_t nsec)
+{
+    memset(an->dir, 0, sizeof(an->dir));
+    an->startNsec = an->lastDump = nsec;
+    an->nextDump = nsec + an->period;
+}
+
+
+void endanalyze(struct parameters *par)
+{
+    struct capture *cap = par->capture;
+    if (cap == NULL || cap->an == NULL)
+    {
+        return;
+    }
+    capture_pause(cap);
+    if (cap->an->csv != NULL)
+    {
+        fclose(cap->an->csv);
+    }
+    pthread_mutex_destroy(&cap->an->lock);
+    free(cap->an);
+    cap->an = NULL;
+    capture_resume(par);
+}
+
+
+// Start the analyzer, dumping a CSV row every "period" msec if "filename"
+// is not NULL
+void startanalyze(struct parameters *par, const char *filename, unsigned long period)
+{
+    endanalyze(par);
+    struct analyzer *an = calloc(1, sizeof(*an));
+    if (an == NULL)
+    {
+        printf("OUT OF MEMORY, NOT ANALYZING\n");
+        return;
+    }
+    if (filename != NULL)
+    {
+        if ((an->csv = fopen(filename, "w")) == NULL)
+        {
+            printf("ERROR OPENING FILE %s, NOT ANALYZING\n", filename);
+            free(an);
+            return;
+        }
+        fputs("time_s", an->csv);
+        for (int i = 0; i < 2; ++i)
+        {
+            const char *d = i == 0 ? "tx2rx" : "rx2tx";
+            fprintf(an->csv, ",%s_bytes,%s_frames,%s_bad_frames,%s_i_frames,%s_retransmissions,"
+                    "%s_rr,%s_rej,%s_srej,%s_goodput_Bps,%s_utilization,%s_rtt_p50_usec",
+                    d, d, d, d, d, d, d, d, d, d, d);
+        }
+        fputc('\n', an->csv);
+    }
+    an->period = period * 1000000ULL;
+    an->fcsSize[0] = an->fcsSize[1] = 1;  // BCC2 until a SET says otherwise
+    struct timespec now;
+    link_now(par, &now);
+    reset_analyzer(an, timespec_to_nsec(&now));
+    pthread_mutex_init(&an->lock, NULL);
+
+    struct capture *cap = capture_open(par);
+    if (cap == NULL)
+    {
+        printf("OUT OF MEMORY, NOT ANALYZING\n");
+        if (an->csv != NULL)
+        {
+            fclose(an->csv);
+        }
+        free(an);
+        return;
+    }
+    cap->an = an;
+    if (capture_resume(par) < 0)
+    {
+        printf("ERROR STARTING CAPTURE THREAD, NOT ANALYZING\n");
+        return;
+    }
+    printf("ANALYZER ON");
+    if (filename != NULL)
+    {
+        printf(", CSV EVERY %lu msec TO FILE %s", period, filename);
+    }
+    printf("\n");
+}
+
+
+// Show the analyzer counters, with rates over the time since it started
+void show_analyzer(struct parameters *par)
+{
+    struct analyzer *an = par->capture->an;
+    struct timespec now;
+    link_now(par, &now);
+    pthread_mutex_lock(&an->lock);
+    double elapsed = (timespec_to_nsec(&now) - an->startNsec) / 1e9;
+    printf("ANALYZER, %.3lf s:\n", elapsed);
+    for (int i = 0; i < 2; ++i)
+    {
+        const struct direction *d = i == 0 ? &par->tx2rx : &par->rx2tx;
+        const struct analyzer_dir *ad = &an->dir[i];
+        printf("   %s: BYTES %llu, FRAMES %llu (BAD %llu), I-FRAMES %llu (RETRANSMITTED %llu), RR %llu, REJ %llu, SREJ %llu\n",
+               d->name, ad->bytes, ad->frames, ad->badFrames, ad->iFrames, ad->retransmissions, ad->rr, ad->rej, ad->srej);
+        if (elapsed > 0)
+        {
+            printf("      GOODPUT %.1lf B/s, UTILIZATION %.1lf%%\n", ad->payload / elapsed,
+                   100.0 * ad->bytes * 10.0 / (elapsed * d->baud));
+        }
+        if (ad->rtt.total > 0)
+        {
+            printf("      I-FRAME TO RR (usec): p50 <= %lld, p99 <= %lld, max = %lld\n",
+                   histogram_percentile(&ad->rtt, 0.50), histogram_percentile(&ad->rtt, 0.99),
+                   ad->rtt.max / 1000);
+        }
+    }
+    pthread_mutex_unlock(&an->lock);
+}
+
+
+// TRUE with the probability of the rule, if it applies to this type
+int frame_rule_hits(struct framer *fr, const struct frame_rule *rule, int type)
+{
+    if (rule->p == 0.0 || !(rule->types & (1u << type)))
+    {
+        return FALSE;
+    }
+    return (rng_next(fr->rng) >> 11) * 0x1.0p-53 < rule->p;
+}
+
+
+void release_held(struct parameters *par, int dir, struct output *out, uint64_t nsec)
+{
+    struct framer *fr = dir == 0 ? &par->tx2rx.fr : &par->rx2tx.fr;
+    deliver_frame(par, dir, out, fr->held, fr->heldLen, nsec);
+    fr->heldLen = 0;
+}
+
+
+// Deliver, drop or copy a byte of a frame, as decided for the frame
+void frame_egress_body(struct parameters *par, int dir, struct output *out, unsigned char byte, uint64_t nsec)
+{
+    struct framer *fr = dir == 0 ? &par->tx2rx.fr : &par->rx2tx.fr;
+    if (fr->action == FA_PASS || fr->action == FA_DUP)
+    {
+        deliver(par, dir, out, byte, nsec);
+    }
+    if ((fr->action == FA_DUP || fr->action == FA_HOLD) && fr->copyLen < FRAME_MAX)
+    {
+        fr->copy[fr->copyLen++] = byte;
+    }
+}
+
+
+// Pass a byte leaving a direction through the frame impairments
+void frame_egress(struct parameters *par, int dir, struct output *out, unsigned char byte, uint64_t nsec)
+{
+    struct framer *fr = dir == 0 ? &par->tx2rx.fr : &par->rx2tx.fr;
+    if (!fr->on)
+    {
+        deliver(par, dir, out, byte, nsec);
+        return;
+    }
+
+    switch (fr->state)
+    {
+        case FR_IDLE:
+            if (byte == FLAG)
+            {
+                fr->head[0] = byte;
+                fr->headLen = 1;
+                fr->state = FR_HEAD;
+            }
+            else
+            {
+                deliver(par, dir, out, byte, nsec);
+            }
+            return;
+
+        case FR_HEAD:
+            if (byte == FLAG)
+            {
+                // What was buffered was not a frame, start again from here
+                deliver_frame(par, dir, out, fr->head, fr->headLen, nsec);
+                fr->headLen = 1;
+                return;
+            }
+            fr->head[fr->headLen++] = byte;
+            if (fr->headLen < 3)
+            {
+                return;
+            }
+
+            // Control field seen: decide what happens to the whole frame
+            int type = frame_type(byte);
+            ++fr->frames;
+            fr->action = FA_PASS;
+            if (frame_rule_hits(fr, &fr->drop, type))
+            {
+                fr->action = FA_DROP;
+                ++fr->dropped;
+            }
+            else if (fr->heldLen == 0 && frame_rule_hits(fr, &fr->hold, type))
+            {
+                fr->action = FA_HOLD;
+                ++fr->heldBack;
+            }
+            else if (frame_rule_hits(fr, &fr->dup, type))
+            {
+                fr->action = FA_DUP;
+                ++fr->duplicated;
+            }
+            fr->copyLen = 0;
+            for (int i = 0; i < 3; ++i)
+            {
+                frame_egress_body(par, dir, out, fr->head[i], nsec);
+            }
+            fr->state = FR_BODY;
+            return;
+
+        case FR_BODY:
+            frame_egress_body(par, dir, out, byte, nsec);
+            if (byte != FLAG)
+            {
+                return;
+            }
+
+            // End of the frame
+            fr->state = FR_IDLE;
+            if (fr->action == FA_DUP && fr->copyLen < FRAME_MAX)
+            {
+                deliver_frame(par, dir, out, fr->copy, fr->copyLen, nsec);
+            }
+            else if (fr->action == FA_HOLD)
+            {
+                if (fr->copyLen == FRAME_MAX)
+                {
+                    // Too long to hold: it is lost
+                    return;
+                }
+                memcpy(fr->held, fr->copy, fr->copyLen);
+                fr->heldLen = fr->copyLen;
+                fr->releaseNsec = nsec + 1000ULL * fr->holdDelay;
+                return;
+            }
+            if (fr->action != FA_DROP && fr->heldLen > 0 && fr->holdDelay == 0)
+            {
+                // A frame passed the held one: reordered
+                release_held(par, dir, out, nsec);
+            }
+            return;
+    }
+}
+
+
+// Deliver whatever the frame impairments still keep and start afresh
+void frame_flush(struct link *link)
+{
+    struct parameters *par = &link->par;
+    struct framer *frs[2] = { &par->tx2rx.fr, &par->rx2tx.fr };
+    int fds[2] = { link->fdRx, link->fdTx };
+    for (int i = 0; i < 2; ++i)
+    {
+        struct framer *fr = frs[i];
+        if (fr->state == FR_HEAD)
+        {
+            write(fds[i], fr->head, fr->headLen);
+        }
+        if (fr->heldLen > 0)
+        {
+            write(fds[i], fr->held, fr->heldLen);
+        }
+        fr->state = FR_IDLE;
+        fr->heldLen = 0;
+    }
+}
+
+
+// Parse "<p> [types]" of a frame rule, types being a comma separated list.
+// Returns 0 on success, -1 on failure.
+int parse_frame_rule(const char *args, struct frame_rule *rule)
+{
+    static const char *names[] = { "i", "rr", "rej", "set", "ua", "disc", "srej", "other" };
+    char list[BUF_SIZE] = "all";
+    double p;
+    if (sscanf(args, "%lf %2047s", &p, list) < 1 || p < 0.0 || p > 1.0)
+    {
+        return -1;
+    }
+    unsigned types = 0;
+    for (char *name = strtok(list, ","); name != NULL; name = strtok(NULL, ","))
+    {
+        int t;
+        for (t = 0; t <= FT_OTHER && strcmp(name, names[t]) != 0; ++t)
+        {
+        }
+        if (t <= FT_OTHER)
+        {
+            types |= 1u << t;
+        }
+        else if (strcmp(name, "all") == 0)
+        {
+            types = FT_ALL;
+        }
+        else
+        {
+            return -1;
+        }
+    }
+    rule->p = p;
+    rule->types = types;
+    return 0;
+}
+
+
+// Ask the sender of a direction to stop or resume with XOFF / XON, sent
+// in the other direction, when the receive FIFO crosses 3/4 or 1/4 of
+// its depth
+void xon_xoff(struct parameters *par, int dir, int queued)
+{
+    struct direction *d = dir == 0 ? &par->tx2rx : &par->rx2tx;
+    struct direction *back = dir == 0 ? &par->rx2tx : &par->tx2rx;
+    if (!d->xoff && queued >= d->fifoDepth * 3 / 4)
+    {
+        back->ctlPending = XOFF;
+        d->xoff = TRUE;
+        ++d->xoffs;
+    }
+    else if (d->xoff && queued <= d->fifoDepth / 4)
+    {
+        back->ctlPending = XON;
+        d->xoff = FALSE;
+    }
+}
+
+
+// Show the timing statistics
+void show_stats(struct parameters *par)
+{
+    if (par->virtualTime)
+    {
+        struct timespec link, wall;
+        link_now(par, &link);
+        clock_gettime(CLOCK_MONOTONIC, &wall);
+        link = timespec_diff(&link, &par->vtimeStartLink);
+        wall = timespec_diff(&wall, &par->vtimeStartWall);
+        double linkSec = timespec_to_nsec(&link) / 1e9, wallSec = timespec_to_nsec(&wall) / 1e9;
+        printf("SIMULATED TIME: %.3lf s IN %.3lf s OF WALL CLOCK (x%.1lf)\n",
+               linkSec, wallSec, wallSec > 0 ? linkSec / wallSec : 0.0);
+    }
+    struct direction *dirs[2] = { &par->tx2rx, &par->rx2tx };
+    for (int i = 0; i < 2; ++i)
+    {
+        const struct direction *d = dirs[i];
+        const struct histogram *h = &d->lateness;
+        printf("%s: %lu BAUD, PROPAGATION DELAY %lu usec, ", d->name, d->baud, d->propDelay);
+        if (d->burstOn)
+        {
+            printf("BURST BER %lg / %lg\n", d->burstBer[GOOD], d->burstBer[BAD]);
+        }
+        else
+        {
+            printf("BER %lg\n", d->ber);
+        }
+        printf("   BYTES DELIVERED: %llu\n", h->total);
+        if (d->loadNsec > 0)
+        {
+            // What the link actually achieved while it was saturated
+            double baud = d->loadBytes * NSEC_PER_BYTE_BAUD / (double) d->loadNsec;
+            printf("   THROUGHPUT UNDER LOAD: %.0lf BAUD (%.2lf%% OF %lu)\n", baud, 100.0 * baud / d->baud, d->baud);
+        }
+        if (h->total > 0)
+        {
+            printf("   LATENESS (usec): p50 <= %lld, p99 <= %lld, max = %lld\n",
+                   histogram_percentile(h, 0.50), histogram_percentile(h, 0.99),
+                   h->max / 1000);
+        }
+        if (d->fr.on)
+        {
+            printf("   FRAMES: %llu, DROPPED %llu, DUPLICATED %llu, HELD BACK %llu\n",
+                   d->fr.frames, d->fr.dropped, d->fr.duplicated, d->fr.heldBack);
+        }
+        if (d->fifoDepth > 0)
+        {
+            static const char *modes[] = { "TAIL DROP", "RTS/CTS", "XON/XOFF" };
+            printf("   FIFO %d BYTES, %s: OVERRUNS %llu", d->fifoDepth, modes[d->flowControl], d->overruns);
+            if (d->flowControl == FC_XONXOFF)
+            {
+                printf(", XOFF SENT %llu%s", d->xoffs, d->stopped ? ", SENDER STOPPED" : "");
+            }
+            printf("\n");
+        }
+    }
+    if (par->capture != NULL && par->capture->an != NULL)
+    {
+        show_analyzer(par);
+    }
+}
+
+
+// Show help
+void help()
+{
+    printf("\n\n");
+    for (int i = 0; i < nLinks; ++i)
+    {
+        if (links[i].nStations > 0)
+        {
+            printf("Link %d: bus, primary must open %s, secondaries %s", i, links[i].txDev, links[i].rxDev);
+            for (int k = 2; k < links[i].nStations; ++k)
+            {
+                printf(", %s", links[i].busDev[k]);
+            }
+            printf("\n");
+            continue;
+        }
+        printf("Link %d: transmitter must open %s, receiver must open %s\n",
+               i, links[i].txDev, links[i].rxDev);
+    }
+    printf("\n"
+           "The cable program is sensible to the following interactive commands:\n"
+           "--- help         : show this help\n"
+           "--- link <n>     : send the following commands to link n (default=0)\n"
+           "--- link all     : send the following commands to every link; files\n"
+           "                   given to log and capture get the link number appended\n"
+           "--- links        : list the links and the worker serving each one\n"
+           "--- on           : connect the cable and data is exchanged (default state)\n"
+           "--- off          : disconnect the cable disabling data to be exchanged\n"
+           "--- ber <ber>    : add noise to data bits at a specified BER (default=0)\n"
+           "--- burst <p> <r> <berGood> <berBad>\n"
+           "                 : add burst noise with a Gilbert-Elliott channel: per bit,\n"
+           "                   go from the good to the bad state with probability p\n"
+           "                   and back with probability r; each state has its BER\n"
+           "--- burst off    : back to the BER set with ber\n"
+           "--- seed <n>     : seed the noise generators, so that the same traffic\n"
+           "                   gets the same errors (random seed by default)\n"
+           "--- baud <rate>  : set baud rate, any rate up to 100000000 (default=9600)\n"
+           "                   note that 10 bits are sent per byte (8-N-1)\n"
+           "--- prop <delay> : set the propagation delay in usec (0-1000000, default=0)\n"
+           "                   will be approximated to an integer multiple of the byte\n"
+           "                   delay (10 / baud_rate)\n"
+           "--- batch <delay>: forward bytes in batches, waking up every <delay> usec\n"
+           "                   (0-100000, default=0, i.e., wake up once per byte)\n"
+           "                   byte timing is kept, only delivery is grouped\n"
+           "--- vtime on [grace]: virtual time: when the link only waits for bytes in\n"
+           "                   flight, its clock jumps ahead instead of sleeping, after\n"
+           "                   <grace> usec without new data (default=1000); endpoints\n"
+           "                   read the link's clock from <port>.clock\n"
+           "--- vtime off    : back to real time\n"
+           "--- frames drop <p> [types]\n"
+           "--- frames dup <p> [types]\n"
+           "--- frames hold <p> <usec> [types]\n"
+           "                 : drop, duplicate or hold back whole 0x7E-delimited frames\n"
+           "                   with probability p; a held frame is delivered <usec>\n"
+           "                   later, or after the next frame if 0 (reordering);\n"
+           "                   types: comma separated i, rr, rej, set, ua, disc, srej,\n"
+           "                   other or all (default)\n"
+           "--- frames off   : back to forwarding bytes only\n"
+           "--- fifo <depth> [drop|rtscts|xonxoff]\n"
+           "                 : limit the receive FIFO of the destination side to\n"
+           "                   <depth> bytes not yet read by its program; when full,\n"
+           "                   arriving bytes are lost (drop, default), the sender\n"
+           "                   stops (rtscts), or XOFF / XON are sent back in-band\n"
+           "                   at 3/4 and 1/4 of the depth (xonxoff)\n"
+           "--- fifo off     : unlimited receive FIFO\n"
+           "--- on a bus (-b), the medium has the baud rate, delay and errors of tx2rx;\n"
+           "    frames and fifo do not apply, and stats also counts collisions\n"
+           "--- tx2rx <cmd>  : apply ber, burst, baud, prop, frames or fifo to the Tx -> Rx\n"
+           "                   direction\n"
+           "--- rx2tx <cmd>  : same, for the Rx -> Tx direction; without a prefix\n"
+           "                   these commands set both directions\n"
+           "--- stats        : show how late bytes were delivered relative to their\n"
+           "                   byte slot (p50, p99 and max)\n"
+           "--- stats reset  : clear the statistics\n"
+           "--- log <file>   : log transmitted data to file\n"
+           "--- endlog       : stop logging transmitted data\n"
+           "--- capture <file>: capture delivered data to a pcap file, one record per\n"
+           "                   0x7E-delimited frame, without slowing down the cable\n"
+           "                   (link type USER0: direction byte, 1 = Tx, then the\n"
+           "                   frame as sent, flags and escapes included)\n"
+           "--- endcapture   : stop capturing\n"
+           "--- analyze on   : count bytes, frames, retransmitted I-frames, RR, REJ and\n"
+           "                   SREJ per direction, goodput, utilization and the time\n"
+           "                   from an I-frame to its RR; shown by stats\n"
+           "--- analyze csv <file> [period]: same, also writing a CSV row every\n"
+           "                   <period> msec (default=1000)\n"
+           "--- analyze off  : stop analyzing\n"
+           "--- scenario <file>: run the commands of a scenario file, one per line as\n"
+           "                   \"<time>s <command>\" or \"<offset>B <command>\", at that\n"
+           "                   link time or number of bytes sent by Tx, counted from\n"
+           "                   the next byte sent; with seed and capture in the file,\n"
+           "                   runs can be replayed and recorded\n"
+           "--- scenario off : drop the scenario\n"
+           "--- quit         : terminate the program\n\n"
+           "IMPORTANT: Changing de baud rate or propagation delay while a transmission is\n"
+           "           ongoing will result in losses.\n"
+           "\n");
+}
+
+int input_pending(struct link *link);
+void process_command(struct link *link, char *rxStdin);
+
+
+int compare_events(const void *a, const void *b)
+{
+    const struct scenario_event *ea = a, *eb = b;
+    if (ea->at != eb->at)
+    {
+        return ea->at < eb->at ? -1 : 1;
+    }
+    return ea->line - eb->line;
+}
+
+
+void free_scenario(struct scenario *scen)
+{
+    free(scen->timed);
+    free(scen->counted);
+    free(scen);
+}
+
+
+void endscenario(struct parameters *par)
+{
+    if (par->scenario != NULL)
+    {
+        free_scenario(par->scenario);
+        par->scenario = NULL;
+    }
+}
+
+
+// Load a scenario file. Each line is "<time>s <command>" or
+// "<offset>B <command>", e.g. "2.0s off" or "4096B ber 1e-4"; empty lines
+// and lines starting with '#' are ignored.
+void startscenario(struct parameters *par, const char *filename)
+{
+    endscenario(par);
+    FILE *file = fopen(filename, "r");
+    if (file == NULL)
+    {
+        printf("ERROR OPENING SCENARIO %s\n", filename);
+        return;
+    }
+    struct scenario *scen = calloc(1, sizeof(*scen));
+    if (scen == NULL)
+    {
+        fclose(file);
+        return;
+    }
+    snprintf(scen->name, sizeof(scen->name), "%s", filename);
+
+    char line[BUF_SIZE];
+    int lineNumber = 0, sizeTimed = 0, sizeCounted = 0;
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        ++lineNumber;
+        line[strcspn(line, "\r\n")] = '\0';
+        char *text = line + strspn(line, " \t");
+        if (*text == '\0' || *text == '#')
+        {
+            continue;
+        }
+
+        struct scenario_event ev = { .line = lineNumber };
+        char *end;
+        double at = strtod(text, &end);
+        if (end != text && *end == 's' && at >= 0.0)
+        {
+            ev.at = (uint64_t) (at * 1e9 + 0.5);
+        }
+        else if (end != text && *end == 'B' && at >= 0.0)
+        {
+            ev.atBytes = TRUE;
+            ev.at = (uint64_t) at;
+        }
+        else
+        {
+            printf("SCENARIO %s, LINE %d: EXPECTED <seconds>s OR <bytes>B\n", filename, lineNumber);
+            fclose(file);
+            free_scenario(scen);
+            return;
+        }
+        ++end;
+        snprintf(ev.command, sizeof(ev.command), "%s", end + strspn(end, " \t"));
+
+        // Grow the list the event goes to
+        struct scenario_event **list = ev.atBytes ? &scen->counted : &scen->timed;
+        int *n = ev.atBytes ? &scen->nCounted : &scen->nTimed;
+        int *size = ev.atBytes ? &sizeCounted : &sizeTimed;
+        if (*n == *size)
+        {
+            *size = *size ? 2 * *size : 16;
+            *list = realloc(*list, *size * sizeof(**list));
+        }
+        (*list)[(*n)++] = ev;
+    }
+    fclose(file);
+    qsort(scen->timed, scen->nTimed, sizeof(*scen->timed), compare_events);
+    qsort(scen->counted, scen->nCounted, sizeof(*scen->counted), compare_events);
+    par->scenario = scen;
+    printf("SCENARIO %s: %d TIMED AND %d BYTE EVENTS, STARTING WITH THE NEXT BYTE SENT\n",
+           filename, scen->nTimed, scen->nCounted);
+}
+
+
+void run_event(struct link *link, struct scenario_event *ev)
+{
+    struct scenario *scen = link->par.scenario;
+    printf("SCENARIO LINK %d, %.6lf s, %llu BYTES: %s\n", link->id,
+           ev->atBytes ? 0.0 : ev->at / 1e9, scen->bytes, ev->command);
+    char command[MAX_SCENARIO_COMMAND];
+    strcpy(command, ev->command);
+    process_command(link, command);
+}
+
+
+// Run the scenario events due before the next slots are handled.
+// Events take effect at exact slot boundaries: the caller handles no slot
+// at or after "*limit" (link time, nsec) and reads no more than
+// "*byteLimit" bytes from Tx in this wakeup.
+void scenario_run(struct link *link, uint64_t *limit, long *byteLimit)
+{
+    struct parameters *par = &link->par;
+    struct scenario *scen = par->scenario;
+    *limit = UINT64_MAX;
+    *byteLimit = BUF_SIZE;
+
+    if (!scen->started)
+    {
+        if (!input_pending(link))
+        {
+            return;
+        }
+        struct timespec first = slot_time(&par->tx2rx, par->tx2rx.slotCount);
+        scen->zero = timespec_to_nsec(&first);
+        scen->started = TRUE;
+        printf("SCENARIO %s STARTED ON LINK %d\n", scen->name, link->id);
+    }
+
+    // The earliest slot either direction handles next (a bus only uses tx2rx)
+    struct timespec tx2rx = slot_time(&par->tx2rx, par->tx2rx.slotCount);
+    struct timespec rx2tx = slot_time(&par->rx2tx, par->rx2tx.slotCount);
+    uint64_t next = link->nStations > 0 || timespec_comp(&tx2rx, &rx2tx) <= 0
+                    ? timespec_to_nsec(&tx2rx) : timespec_to_nsec(&rx2tx);
+
+    while (scen->nextTimed < scen->nTimed && scen->zero + scen->timed[scen->nextTimed].at <= next)
+    {
+        run_event(link, &scen->timed[scen->nextTimed++]);
+        if (par->scenario != scen)
+        {
+            // The event replaced or ended the scenario
+            return;
+        }
+    }
+    while (scen->nextCounted < scen->nCounted && scen->counted[scen->nextCounted].at <= scen->bytes)
+    {
+        run_event(link, &scen->counted[scen->nextCounted++]);
+        if (par->scenario != scen)
+        {
+            return;
+        }
+    }
+
+    if (scen->nextTimed < scen->nTimed)
+    {
+        *limit = scen->zero + scen->timed[scen->nextTimed].at;
+    }
+    if (scen->nextCounted < scen->nCounted)
+    {
+        *byteLimit = scen->counted[scen->nextCounted].at - scen->bytes;
+    }
+    if (scen->nextTimed == scen->nTimed && scen->nextCounted == scen->nCounted)
+    {
+        printf("SCENARIO %s DONE ON LINK %d\n", scen->name, link->id);
+        endscenario(par);
+    }
+}
+
+
+// Link time of the next timed scenario event, if one is waiting
+int scenario_wakeup(struct parameters *par, struct timespec *t)
+{
+    struct scenario *scen = par->scenario;
+    if (scen == NULL || !scen->started || scen->nextTimed == scen->nTimed)
+    {
+        return FALSE;
+    }
+    uint64_t at = scen->zero + scen->timed[scen->nextTimed].at;
+    t->tv_sec = at / 1000000000;
+    t->tv_nsec = at % 1000000000;
+    return TRUE;
+}
+
+
+// Handle every byte slot that is due: read from both sides, move the bytes
+// through the ring buffers and write what leaves them. Each direction has
+// its own slots; those of both directions are handled in time order.
+// Returns TRUE while bytes are in flight or the sides may have more to send,
+// FALSE when the cable became idle.
+int forward(struct link *link)
+{
+    struct parameters *par = &link->par;
+    struct direction *dirs[2] = { &par->tx2rx, &par->rx2tx };
+    int fdIn[2] = { link->fdTx, link->fdRx };
+    int slaveOut[2] = { link->slaveRx, link->slaveTx };
+    int throttled = FALSE;
+
+    // Bytes read from / to be written to each side during one wakeup
+    char in[2][BUF_SIZE];
+    struct output out[2] = { { .fd = link->fdRx }, { .fd = link->fdTx } };
+    int bytesIn[2];
+    long slots[2];
+    long long lateFirst[2];
+    uint64_t firstSlotNsec[2];
+
+    // Scenario events first, as they may change what follows
+    uint64_t limit = UINT64_MAX;
+    long byteLimit = BUF_SIZE;
+    if (par->scenario != NULL)
+    {
+        scenario_run(link, &limit, &byteLimit);
+    }
+
+    struct timespec currentTime;
+    link_now(par, &currentTime);
+    for (int i = 0; i < 2; ++i)
+    {
+        // Check how many byte slots are due since the last wakeup
+        struct timespec firstSlot = slot_time(dirs[i], dirs[i]->slotCount);
+        struct timespec timeDiff = timespec_diff(&currentTime, &firstSlot);
+        if (timeDiff.tv_sec >= 1)
+        {
+            if (par->unreliableRate == FALSE)
+            {
+                printf("LINK %d UNRELIABLE RATE: Could not keep up, timeDiff exceeded 1s\n"
+                       "No further warnings will be issued\n", link->id);
+                par->unreliableRate = TRUE;
+            }
+        }
+        slots[i] = slots_due(dirs[i], &currentTime);
+        if (limit != UINT64_MAX)
+        {
+            // Stop before the slot of the next scenario event
+            long long before = slots_until(dirs[i], limit);
+            slots[i] = slots[i] < before ? slots[i] : before;
+        }
+        dirs[i]->slotCount += slots[i];
+        lateFirst[i] = timespec_to_nsec(&timeDiff);
+        firstSlotNsec[i] = timespec_to_nsec(&firstSlot);
+
+        // Receive FIFO of the destination side: the bytes its program has
+        // not read yet are in the input queue of the slave we keep open
+        long toRead = slots[i];
+        struct direction *d = dirs[i];
+        if (d->fifoDepth > 0)
+        {
+            int queued = 0;
+            ioctl(slaveOut[i], FIONREAD, &queued);
+            out[i].room = d->fifoDepth - queued;
+            if (d->flowControl == FC_RTSCTS && toRead > out[i].room - d->inFlight)
+            {
+                // CTS is checked before each byte
+                toRead = out[i].room - d->inFlight > 0 ? out[i].room - d->inFlight : 0;
+            }
+            else if (d->flowControl == FC_XONXOFF)
+            {
+                xon_xoff(par, i, queued);
+                throttled = throttled || d->xoff;
+            }
+        }
+        if (d->stopped)
+        {
+            toRead = 0;
+        }
+        if (d->ctlPending && toRead == slots[i] && toRead > 0)
+        {
+            // Leave the first slot for the flow control byte
+            --toRead;
+        }
+        throttled = throttled || d->ctlPending || toRead < slots[i];
+        if (i == 0 && toRead > byteLimit)
+        {
+            // Leave the next bytes for after the scenario event
+            toRead = byteLimit;
+        }
+
+        // Read at most one byte per slot
+        bytesIn[i] = toRead > 0 ? read(fdIn[i], in[i], toRead) : 0;
+        if (bytesIn[i] < 0)
+        {
+            bytesIn[i] = 0;
+        }
+        if (i == 0 && par->scenario != NULL && par->scenario->started)
+        {
+            par->scenario->bytes += bytesIn[0];
+        }
+
+        // A frame held back for a while may be due
+        struct framer *fr = &dirs[i]->fr;
+        if (fr->heldLen > 0 && fr->holdDelay > 0 && (uint64_t) timespec_to_nsec(&currentTime) >= fr->releaseNsec)
+        {
+            release_held(par, i, &out[i], fr->releaseNsec);
+        }
+    }
+
+    long slot[2] = { 0, 0 };
+    long delivered[2] = { 0, 0 };
+    while (slot[0] < slots[0] || slot[1] < slots[1])
+    {
+        // Take the earliest pending slot, of both directions if they coincide
+        uint64_t t[2];
+        for (int i = 0; i < 2; ++i)
+        {
+            t[i] = slot[i] < slots[i] ? timespec_to_nsec(&dirs[i]->slotEpoch)
+                   + slot_offset(dirs[i], dirs[i]->slotCount - slots[i] + slot[i]) : UINT64_MAX;
+        }
+        uint64_t now = t[0] < t[1] ? t[0] : t[1];
+        struct log_record rec = { .flags = 0 };
+
+        for (int i = 0; i < 2; ++i)
+        {
+            struct direction *d = dirs[i];
+            if (t[i] != now)
+            {
+                continue;
+            }
+            long entry = d->idx & d->mask;
+            long leaving = ring_out(d, 0);
+
+            // Bytes read in this wakeup occupy the last slots of the batch,
+            // so that none is delivered earlier than it could have been sent.
+            // While the cable is off, what was read is ignored.
+            long first = slots[i] - bytesIn[i];
+            d->valid[entry] = par->cableOn && slot[i] >= first;
+            if (d->valid[entry])
+            {
+                d->ring[entry] = in[i][slot[i] - first];
+            }
+            else if (par->cableOn && d->ctlPending)
+            {
+                // XON / XOFF, marked so that the other side's UART takes it
+                d->ring[entry] = d->ctlPending;
+                d->valid[entry] = 2;
+                d->ctlPending = 0;
+            }
+            if (d->valid[entry])
+            {
+                rec.flags |= LOG_IN(i);
+                rec.byte[2 * i] = d->ring[entry];
+            }
+            d->inFlight += d->valid[entry] != 0;
+            ++d->idx;
+
+            if (par->cableOn && d->valid[leaving] == 2)
+            {
+                // Flow control for the other direction, not delivered
+                dirs[!i]->stopped = d->ring[leaving] == XOFF;
+            }
+            else if (par->cableOn && d->valid[leaving])
+            {
+                // Add errors, if applicable
+                add_noise(d, d->ring + leaving);
+                frame_egress(par, i, &out[i], d->ring[leaving], now);
+                histogram_add(&d->lateness, lateFirst[i] - (now - firstSlotNsec[i]), 1);
+                ++delivered[i];
+                rec.flags |= LOG_OUT(i);
+                rec.byte[2 * i + 1] = d->ring[leaving];
+            }
+
+            // The byte leaving the ring buffer is no longer in flight
+            d->inFlight -= d->valid[leaving] != 0;
+            d->valid[leaving] = 0;
+            ++slot[i];
+        }
+
+        if (par->log != NULL)
+        {
+            log_slot(par, &rec);
+        }
+    }
+
+    // One write per direction for all the bytes leaving the ring buffers.
+    // While flow control holds a sender back, keep checking the FIFOs.
+    int busy = throttled && input_pending(link);
+    busy = busy || (par->scenario != NULL && bytesIn[0] == byteLimit && byteLimit > 0);
+    for (int i = 0; i < 2; ++i)
+    {
+        if (out[i].len > 0)
+        {
+            write(out[i].fd, out[i].buf, out[i].len);
+        }
+        measure_load(dirs[i], slots[i], delivered[i], &currentTime);
+        // A side that filled every slot may still have bytes waiting
+        busy = busy || dirs[i]->inFlight > 0 || dirs[i]->fr.heldLen > 0 || dirs[i]->ctlPending
+               || dirs[i]->xoff || (slots[i] > 0 && bytesIn[i] == slots[i]);
+    }
+    return busy;
+}
+
+
+// Master side of the port of a bus station: 0 is the primary
+int station_fd(struct link *link, int station)
+{
+    return station == 0 ? link->fdTx : station == 1 ? link->fdRx : link->busFd[station];
+}
+
+
+// Bus mode: the stations share one half-duplex medium, with the rate, delay
+// and errors of the tx2rx direction. A byte sent in a slot reaches every
+// other station. When several stations send in the same slot they collide,
+// and the others get the wired-AND of their bytes.
+// Returns TRUE while bytes are in flight or stations may have more to send.
+int forward_bus(struct link *link)
+{
+    struct parameters *par = &link->par;
+    struct direction *d = &par->tx2rx;
+    int n = link->nStations;
+
+    char in[MAX_STATIONS][BUF_SIZE];
+    char out[MAX_STATIONS][BUF_SIZE];
+    int bytesIn[MAX_STATIONS], bytesOut[MAX_STATIONS] = { 0 };
+
+    uint64_t limit = UINT64_MAX;
+    long byteLimit = BUF_SIZE;
+    if (par->scenario != NULL)
+    {
+        scenario_run(link, &limit, &byteLimit);
+    }
+
+    struct timespec currentTime, firstSlot, timeDiff;
+    link_now(par, &currentTime);
+    firstSlot = slot_time(d, d->slotCount);
+    timeDiff = timespec_diff(&currentTime, &firstSlot);
+    if (timeDiff.tv_sec >= 1 && par->unreliableRate == FALSE)
+    {
+        printf("LINK %d UNRELIABLE RATE: Could not keep up, timeDiff exceeded 1s\n"
+               "No further warnings will be issued\n", link->id);
+        par->unreliableRate = TRUE;
+    }
+    long slots = slots_due(d, &currentTime);
+    uint64_t firstSlotNsec = timespec_to_nsec(&firstSlot);
+    if (limit != UINT64_MAX)
+    {
+        long long before = slots_until(d, limit);
+        slots = slots < before ? slots : before;
+    }
+    long long firstCount = d->slotCount;
+    long delivered = 0;
+    d->slotCount += slots;
+    long long lateFirst = timespec_to_nsec(&timeDiff);
+
+    // Each station sends at most one byte per slot
+    int full = FALSE;
+    for (int k = 0; k < n; ++k)
+    {
+        long toRead = k == 0 && slots > byteLimit ? byteLimit : slots;
+        bytesIn[k] = toRead > 0 ? read(station_fd(link, k), in[k], toRead) : 0;
+        if (bytesIn[k] < 0)
+        {
+            bytesIn[k] = 0;
+        }
+        full = full || (slots > 0 && bytesIn[k] == toRead);
+    }
+    if (par->scenario != NULL && par->scenario->started)
+    {
+        par->scenario->bytes += bytesIn[0];
+    }
+
+    for (long slot = 0; slot < slots; ++slot)
+    {
+        // Put on the medium what the stations sent in this slot, their
+        // bytes taking the last slots of the batch as in forward()
+        uint32_t senders = 0;
+        unsigned char wire = 0xFF;
+        for (int k = 0; k < n; ++k)
+        {
+            long first = slots - bytesIn[k];
+            if (slot >= first)
+            {
+                senders |= 1u << k;
+                wire &= in[k][slot - first];
+                ++par->busSent[k];
+            }
+        }
+        if (senders & (senders - 1))
+        {
+            ++par->collisions;
+        }
+        long entry = d->idx & d->mask;
+        long leaving = ring_out(d, 0);
+        struct log_record rec = { .flags = LOG_BUS };
+        d->valid[entry] = par->cableOn && senders != 0;
+        d->ring[entry] = wire;
+        d->senders[entry] = senders;
+        d->inFlight += d->valid[entry];
+        if (d->valid[entry])
+        {
+            rec.flags |= LOG_IN(0);
+            rec.byte[0] = wire;
+        }
+        ++d->idx;
+
+        if (par->cableOn && d->valid[leaving])
+        {
+            add_noise(d, d->ring + leaving);
+            for (int k = 0; k < n; ++k)
+            {
+                if (!(d->senders[leaving] & (1u << k)))
+                {
+                    out[k][bytesOut[k]++] = d->ring[leaving];
+                }
+            }
+            uint64_t slotNsec = timespec_to_nsec(&d->slotEpoch) + slot_offset(d, firstCount + slot);
+            histogram_add(&d->lateness, lateFirst - (slotNsec - firstSlotNsec), 1);
+            ++delivered;
+            if (par->capture != NULL)
+            {
+                capture_push(&par->capture->tx2rx, slotNsec, d->ring[leaving]);
+            }
+            rec.flags |= LOG_OUT(0);
+            rec.byte[1] = d->ring[leaving];
+        }
+        d->inFlight -= d->valid[leaving];
+        d->valid[leaving] = 0;
+
+        if (par->log != NULL)
+        {
+            log_slot(par, &rec);
+        }
+    }
+
+    for (int k = 0; k < n; ++k)
+    {
+        if (bytesOut[k] > 0)
+        {
+            write(station_fd(link, k), out[k], bytesOut[k]);
+        }
+    }
+    measure_load(d, slots, delivered, &currentTime);
+    return d->inFlight > 0 || full;
+}
+
+
+void show_bus(struct link *link)
+{
+    struct parameters *par = &link->par;
+    printf("BUS: %d STATIONS, %llu COLLISIONS\n", link->nStations, par->collisions);
+    for (int k = 0; k < link->nStations; ++k)
+    {
+        printf("   %s %s: %llu BYTES SENT\n", k == 0 ? "PRIMARY" : "SECONDARY",
+               k == 0 ? link->txDev : k == 1 ? link->rxDev : link->busDev[k], par->busSent[k]);
+    }
+}
+
+
+// With several links selected, each one logs to its own file, "<name>.<id>".
+// Returns NULL if that name does not fit in "buf".
+const char *link_file(struct link *link, const char *name, char *buf, size_t size)
+{
+    if (selectedLink >= 0)
+    {
+        return name;
+    }
+    int len = snprintf(buf, size, "%s.%d", name, link->id);
+    if (len < 0 || (size_t) len >= size)
+    {
+        printf("FILE NAME TOO LONG\n");
+        return NULL;
+    }
+    return buf;
+}
+
+
+// Execute one interactive command on a link, with the link locked
+void process_command(struct link *link, char *rxStdin)
+{
+    struct parameters *par = &link->par;
+    char filename[BUF_SIZE];
+
+    // Commands setting a direction's rate, delay or errors apply to both
+    // directions, unless prefixed with the one to change
+    struct direction *dirs[2] = { &par->tx2rx, &par->rx2tx };
+    int nDirs = 2;
+    if (strncmp(rxStdin, "tx2rx ", 6) == 0 || strncmp(rxStdin, "rx2tx ", 6) == 0)
+    {
+        dirs[0] = rxStdin[0] == 't' ? &par->tx2rx : &par->rx2tx;
+        nDirs = 1;
+        rxStdin += 6;
+        if (strncmp(rxStdin, "ber ", 4) != 0 && strncmp(rxStdin, "burst ", 6) != 0
+            && strncmp(rxStdin, "baud ", 5) != 0 && strncmp(rxStdin, "prop ", 5) != 0
+            && strncmp(rxStdin, "frames ", 7) != 0 && strncmp(rxStdin, "fifo ", 5) != 0)
+        {
+            printf("ONLY ber, burst, baud, prop, frames AND fifo CAN BE SET PER DIRECTION\n");
+            return;
+        }
+    }
+
+    if (strcmp(rxStdin, "off") == 0)
+    {
+        printf("CONNECTION OFF\n");
+        if (par->cableOn && par->log != NULL)
+        {
+            log_push(par->log, &(struct log_record) { .flags = LOG_CABLE_OFF });
+        }
+        par->cableOn = FALSE;
+    }
+    else if (strcmp(rxStdin, "on") == 0)
+    {
+        printf("CONNECTION ON\n");
+        par->cableOn = TRUE;
+    }
+    else if (strncmp(rxStdin, "ber ", 4) == 0)
+    {
+        double ber = -1.0;
+        sscanf(rxStdin + 4, "%lf", &ber);
+        if (ber >= 0.0 && ber < 1.0)
+        {
+            for (int i = 0; i < nDirs; ++i)
+            {
+                if (dirs[i]->burstOn)
+                {
+                    printf("%s BURST ERRORS OFF\n", dirs[i]->name);
+                }
+                dirs[i]->ber = ber;
+                dirs[i]->burstOn = FALSE;
+                set_error_model(dirs[i]);
+                printf("%s BER SET TO %lg\n", dirs[i]->name, ber);
+            }
+        }
+        else
+        {
+            printf("BAD BER VALUE %lf (MUST BE 0 <= BER < 1.0)\n", ber);
+        }
+    }
+    else if (strcmp(rxStdin, "burst off") == 0)
+    {
+        for (int i = 0; i < nDirs; ++i)
+        {
+            dirs[i]->burstOn = FALSE;
+            set_error_model(dirs[i]);
+            printf("%s BURST ERRORS OFF, BER IS %lg\n", dirs[i]->name, dirs[i]->ber);
+        }
+    }
+    else if (strncmp(rxStdin, "burst ", 6) == 0)
+    {
+        double p, r, berGood, berBad;
+        if (sscanf(rxStdin + 6, "%lf %lf %lf %lf", &p, &r, &berGood, &berBad) < 4
+            || p < 0.0 || p > 1.0 || r < 0.0 || r > 1.0
+            || berGood < 0.0 || berGood >= 1.0 || berBad < 0.0 || berBad >= 1.0)
+        {
+            printf("BAD BURST PARAMETERS (MUST BE 0 <= P, R <= 1 AND 0 <= BER < 1.0)\n");
+        }
+        else
+        {
+            for (int i = 0; i < nDirs; ++i)
+            {
+                dirs[i]->burstOn = TRUE;
+                dirs[i]->burstSwitch[GOOD] = p;
+                dirs[i]->burstSwitch[BAD] = r;
+                dirs[i]->burstBer[GOOD] = berGood;
+                dirs[i]->burstBer[BAD] = berBad;
+                set_error_model(dirs[i]);
+                printf("%s BURST ERRORS ON: GOOD->BAD %lg, BAD->GOOD %lg, BER %lg / %lg\n",
+                       dirs[i]->name, p, r, berGood, berBad);
             }
-            if (par.rx2txValid[par.rx2txIdx])
+            // Stationary probability of the BAD state
+            double bad = p + r > 0.0 ? p / (p + r) : 0.0;
+            printf("   TIME IN BAD STATE %.2lf%%, MEAN BURST %lg BITS, AVERAGE BER %lg\n",
+                   100.0 * bad, r > 0.0 ? 1.0 / r : 0.0,
+                   (1.0 - bad) * berGood + bad * berBad);
+        }
+    }
+    else if (strcmp(rxStdin, "frames off") == 0)
+    {
+        for (int i = 0; i < nDirs; ++i)
+        {
+            memset(&dirs[i]->fr.drop, 0, sizeof(struct frame_rule));
+            memset(&dirs[i]->fr.dup, 0, sizeof(struct frame_rule));
+            memset(&dirs[i]->fr.hold, 0, sizeof(struct frame_rule));
+            dirs[i]->fr.on = FALSE;
+            printf("%s FRAME IMPAIRMENTS OFF\n", dirs[i]->name);
+        }
+        frame_flush(link);
+    }
+    else if (strncmp(rxStdin, "frames ", 7) == 0)
+    {
+        struct frame_rule rule;
+        unsigned long holdDelay = 0;
+        const char *args = rxStdin + 7;
+        int n = 0;
+        if (strncmp(args, "hold ", 5) == 0)
+        {
+            // frames hold <p> <usec> [types]
+            double p;
+            if (sscanf(args + 5, "%lf %lu %n", &p, &holdDelay, &n) < 2 || holdDelay > 10000000)
             {
-                sprintf(rx2txTx, "%02hhX", par.rx2tx[par.rx2txIdx]);
+                n = -1;
             }
             else
             {
-                memcpy(rx2txTx, "  ", 3);
+                // Keep the probability, skip the delay
+                char buf[BUF_SIZE];
+                snprintf(buf, sizeof(buf), "%lf %s", p, args + 5 + n);
+                n = parse_frame_rule(buf, &rule);
+            }
+        }
+        else if (strncmp(args, "drop ", 5) == 0 || strncmp(args, "dup ", 4) == 0)
+        {
+            n = parse_frame_rule(strchr(args, ' ') + 1, &rule);
+        }
+        else
+        {
+            n = -1;
+        }
+
+        if (n < 0)
+        {
+            printf("BAD FRAME IMPAIRMENT (frames drop|dup <p> [types] OR frames hold <p> <usec> [types])\n");
+        }
+        else
+        {
+            for (int i = 0; i < nDirs; ++i)
+            {
+                struct framer *fr = &dirs[i]->fr;
+                if (args[1] == 'r')
+                {
+                    fr->drop = rule;
+                }
+                else if (args[1] == 'u')
+                {
+                    fr->dup = rule;
+                }
+                else
+                {
+                    fr->hold = rule;
+                    fr->holdDelay = holdDelay;
+                }
+                fr->on = TRUE;
+                printf("%s FRAMES: DROP %lg (0x%02X), DUPLICATE %lg (0x%02X), HOLD %lg (0x%02X) FOR %lu usec\n",
+                       dirs[i]->name, fr->drop.p, fr->drop.types, fr->dup.p, fr->dup.types,
+                       fr->hold.p, fr->hold.types, fr->holdDelay);
+            }
+        }
+    }
+    else if (strcmp(rxStdin, "fifo off") == 0)
+    {
+        for (int i = 0; i < nDirs; ++i)
+        {
+            dirs[i]->fifoDepth = 0;
+            dirs[i]->xoff = FALSE;
+            (dirs[i] == &par->tx2rx ? &par->rx2tx : &par->tx2rx)->stopped = FALSE;
+            printf("%s RECEIVE FIFO UNLIMITED\n", dirs[i]->name);
+        }
+    }
+    else if (strncmp(rxStdin, "fifo ", 5) == 0)
+    {
+        int depth = 0;
+        char mode[16] = "drop";
+        sscanf(rxStdin + 5, "%d %15s", &depth, mode);
+        int flowControl = strcmp(mode, "drop") == 0 ? FC_NONE
+                        : strcmp(mode, "rtscts") == 0 ? FC_RTSCTS
+                        : strcmp(mode, "xonxoff") == 0 ? FC_XONXOFF : -1;
+        if (depth < 4 || depth > 4000 || flowControl < 0)
+        {
+            printf("BAD FIFO (fifo <depth> [drop|rtscts|xonxoff], 4 <= depth <= 4000)\n");
+        }
+        else
+        {
+            for (int i = 0; i < nDirs; ++i)
+            {
+                dirs[i]->fifoDepth = depth;
+                dirs[i]->flowControl = flowControl;
+                dirs[i]->xoff = FALSE;
+                (dirs[i] == &par->tx2rx ? &par->rx2tx : &par->tx2rx)->stopped = FALSE;
+                printf("%s RECEIVE FIFO %d BYTES, %s\n", dirs[i]->name, depth, mode);
+            }
+        }
+    }
+    else if (strncmp(rxStdin, "seed ", 5) == 0)
+    {
+        unsigned long long seed;
+        if (sscanf(rxStdin + 5, "%llu", &seed) < 1)
+        {
+            printf("BAD SEED\n");
+        }
+        else
+        {
+            seed_channels(par, seed);
+            printf("SEED SET TO %llu\n", seed);
+        }
+    }
+    else if (strncmp(rxStdin, "baud ", 5) == 0)
+    {
+        unsigned long baud = 0;
+        sscanf(rxStdin + 5, "%lu", &baud);
+        if (baud >= 1 && baud <= MAX_BAUDRATE)
+        {
+            for (int i = 0; i < nDirs; ++i)
+            {
+                set_baud_rate(par, dirs[i], baud);
+            }
+        }
+        else
+        {
+            printf("UNSUPPORTED BAUD RATE: must be between 1 and %d\n", MAX_BAUDRATE);
+        }
+    }
+    else if (strncmp(rxStdin, "prop ", 5) == 0)
+    {
+        unsigned long propDelay;
+        if (sscanf(rxStdin + 5, "%lu", &propDelay) < 1 || propDelay > 1000000)
+        {
+            printf("BAD OR OUT OF RANGE PROPAGATION DELAY\n");
+        }
+        else
+        {
+            for (int i = 0; i < nDirs; ++i)
+            {
+                dirs[i]->propDelay = propDelay;
+                init_ring_buffers(dirs[i]);
+            }
+        }
+    }
+    else if (strncmp(rxStdin, "batch ", 6) == 0)
+    {
+        unsigned long batchDelay;
+        if (sscanf(rxStdin + 6, "%lu", &batchDelay) < 1 || batchDelay > 100000)
+        {
+            printf("BAD OR OUT OF RANGE BATCH DELAY\n");
+        }
+        else
+        {
+            par->batchDelay = batchDelay;
+            init_batch(par, &par->tx2rx);
+            init_batch(par, &par->rx2tx);
+            printf("BATCH SET TO %ld / %ld BYTES PER WAKEUP (TX2RX / RX2TX)\n",
+                   par->tx2rx.batchSlots, par->rx2tx.batchSlots);
+        }
+    }
+    else if (strcmp(rxStdin, "vtime off") == 0)
+    {
+        par->virtualTime = FALSE;
+        printf("VIRTUAL TIME OFF, LINK CLOCK IS %.3lf s AHEAD\n", par->clockOffset / 1e9);
+    }
+    else if (strncmp(rxStdin, "vtime on", 8) == 0)
+    {
+        unsigned long graceDelay = DEFAULT_GRACE_DELAY;
+        if (rxStdin[8] != '\0' && (sscanf(rxStdin + 8, "%lu", &graceDelay) < 1 || graceDelay > 1000000))
+        {
+            printf("BAD OR OUT OF RANGE GRACE DELAY\n");
+        }
+        else
+        {
+            if (!par->virtualTime)
+            {
+                link_now(par, &par->vtimeStartLink);
+                clock_gettime(CLOCK_MONOTONIC, &par->vtimeStartWall);
+            }
+            par->virtualTime = TRUE;
+            par->graceDelay = graceDelay;
+            printf("VIRTUAL TIME ON, CLOCK IN %s%s (GRACE %lu usec)\n",
+                   link->txDev, CABLE_CLOCK_SUFFIX, graceDelay);
+        }
+    }
+    else if (strcmp(rxStdin, "stats") == 0)
+    {
+        show_stats(par);
+        if (link->nStations > 0)
+        {
+            show_bus(link);
+        }
+    }
+    else if (strcmp(rxStdin, "stats reset") == 0)
+    {
+        // Every counter shown by "stats", so that they all start again now
+        struct direction *dirs[2] = { &par->tx2rx, &par->rx2tx };
+        for (int i = 0; i < 2; ++i)
+        {
+            struct direction *d = dirs[i];
+            memset(&d->lateness, 0, sizeof(d->lateness));
+            d->loadBytes = d->loadNsec = 0;
+            d->fr.frames = d->fr.dropped = d->fr.duplicated = d->fr.heldBack = 0;
+            d->overruns = d->xoffs = 0;
+        }
+        memset(par->busSent, 0, sizeof(par->busSent));
+        par->collisions = 0;
+        if (par->capture != NULL && par->capture->an != NULL)
+        {
+            struct timespec now;
+            link_now(par, &now);
+            pthread_mutex_lock(&par->capture->an->lock);
+            reset_analyzer(par->capture->an, timespec_to_nsec(&now));
+            pthread_mutex_unlock(&par->capture->an->lock);
+        }
+        printf("STATISTICS RESET\n");
+    }
+    else if (strncmp(rxStdin, "log ", 4) == 0)
+    {
+        const char *file = link_file(link, rxStdin + 4, filename, sizeof(filename));
+        if (file != NULL)
+        {
+            startlog(par, file);
+        }
+    }
+    else if (strncmp(rxStdin, "capture ", 8) == 0)
+    {
+        const char *file = link_file(link, rxStdin + 8, filename, sizeof(filename));
+        if (file != NULL)
+        {
+            startcapture(par, file);
+        }
+    }
+    else if (strcmp(rxStdin, "analyze on") == 0)
+    {
+        startanalyze(par, NULL, 0);
+    }
+    else if (strncmp(rxStdin, "analyze csv ", 12) == 0)
+    {
+        char name[BUF_SIZE];
+        unsigned long period = 1000;
+        if (sscanf(rxStdin + 12, "%2047s %lu", name, &period) < 1 || period < 20 || period > 3600000)
+        {
+            printf("BAD CSV FILE OR PERIOD (20-3600000 msec)\n");
+        }
+        else
+        {
+            const char *file = link_file(link, name, filename, sizeof(filename));
+            if (file != NULL)
+            {
+                startanalyze(par, file, period);
+            }
+        }
+    }
+    else if (strcmp(rxStdin, "analyze off") == 0)
+    {
+        endanalyze(par);
+        printf("ANALYZER OFF\n");
+    }
+    else if (strcmp(rxStdin, "scenario off") == 0)
+    {
+        endscenario(par);
+        printf("NO SCENARIO\n");
+    }
+    else if (strncmp(rxStdin, "scenario ", 9) == 0)
+    {
+        startscenario(par, rxStdin + 9);
+    }
+    else if (strcmp(rxStdin, "endcapture") == 0)
+    {
+        endcapture(par);
+        printf("NOT CAPTURING\n");
+    }
+    else if (strcmp(rxStdin, "endlog") == 0)
+    {
+        endlog(par);
+        printf("NOT LOGGING\n");
+    }
+    else {
+        printf("BAD COMMAND OR MISSING PARAMETERS\n");
+    }
+}
+
+
+// List the links and the worker serving each one
+void show_links(void)
+{
+    for (int i = 0; i < nLinks; ++i)
+    {
+        printf("LINK %d: %s %s %s%s, WORKER %d (CPU %d), %s%s\n", i,
+               links[i].txDev, links[i].nStations > 0 ? "+" : "->", links[i].rxDev,
+               links[i].nStations > 2 ? " + ..." : "", links[i].worker->id, links[i].worker->cpu,
+               links[i].par.cableOn ? "ON" : "OFF", i == selectedLink ? " (SELECTED)" : "");
+    }
+}
+
+
+// Execute one line read from stdin.
+// Returns TRUE if the program should terminate.
+int run_command(char *command)
+{
+    if (strcmp(command, "quit") == 0)
+    {
+        printf("END OF THE PROGRAM\n");
+        return TRUE;
+    }
+    else if (strcmp(command, "help") == 0)
+    {
+        help();
+    }
+    else if (strcmp(command, "links") == 0)
+    {
+        show_links();
+    }
+    else if (strcmp(command, "link all") == 0)
+    {
+        selectedLink = -1;
+        printf("COMMANDS GO TO ALL %d LINKS\n", nLinks);
+    }
+    else if (strncmp(command, "link ", 5) == 0)
+    {
+        int id;
+        if (sscanf(command + 5, "%d", &id) < 1 || id < 0 || id >= nLinks)
+        {
+            printf("BAD LINK NUMBER (MUST BE 0 TO %d OR all)\n", nLinks - 1);
+        }
+        else
+        {
+            selectedLink = id;
+            printf("COMMANDS GO TO LINK %d (%s -> %s)\n", id, links[id].txDev, links[id].rxDev);
+        }
+    }
+    else
+    {
+        for (int i = 0; i < nLinks; ++i)
+        {
+            if (selectedLink >= 0 && selectedLink != i)
+            {
+                continue;
+            }
+            if (selectedLink < 0 && nLinks > 1)
+            {
+                printf("LINK %d: ", i);
             }
+            pthread_mutex_lock(&links[i].lock);
+            process_command(&links[i], command);
+            pthread_mutex_unlock(&links[i].lock);
+        }
+    }
+    return FALSE;
+}
+
+
+volatile sig_atomic_t interrupted = FALSE;
+
+void interrupt_handler(int signal)
+{
+    interrupted = TRUE;
+}
+
+
+// Select the events the worker waits for on the serial ports of a link:
+// while the link is forwarding, its timer paces the reads and the ports are
+// not watched
+void watch_ports(struct link *link, int watch)
+{
+    if (link->watching == watch)
+    {
+        return;
+    }
+    link->watching = watch;
+    struct epoll_event ev = { .events = watch ? EPOLLIN : 0 };
+    ev.data.u64 = EV_DATA(link->index, EV_TX);
+    epoll_ctl(link->worker->epfd, EPOLL_CTL_MOD, link->fdTx, &ev);
+    ev.data.u64 = EV_DATA(link->index, EV_RX);
+    epoll_ctl(link->worker->epfd, EPOLL_CTL_MOD, link->fdRx, &ev);
+    for (int k = 2; k < link->nStations; ++k)
+    {
+        epoll_ctl(link->worker->epfd, EPOLL_CTL_MOD, link->busFd[k], &ev);
+    }
+}
+
+
+// Arm the timer of a link to expire at the absolute link time "deadline",
+// or disarm it if "deadline" is NULL. A deadline already in the past expires
+// at once, so a late wakeup never delays the following ones.
+void arm_timer(struct link *link, const struct timespec *deadline)
+{
+    struct itimerspec its = {0};
+    if (deadline != NULL)
+    {
+        long long nsec = timespec_to_nsec(deadline) - link->par.clockOffset;
+        its.it_value.tv_sec = nsec / 1000000000;
+        its.it_value.tv_nsec = nsec % 1000000000;
+    }
+    timerfd_settime(link->timerFd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+
+// TRUE if either side has bytes the cable has not read yet
+int input_pending(struct link *link)
+{
+    int pendingTx = 0, pendingRx = 0;
+    ioctl(link->fdTx, FIONREAD, &pendingTx);
+    ioctl(link->fdRx, FIONREAD, &pendingRx);
+    for (int k = 2; k < link->nStations && pendingRx == 0; ++k)
+    {
+        ioctl(link->busFd[k], FIONREAD, &pendingRx);
+    }
+    return pendingTx > 0 || pendingRx > 0;
+}
+
+
+// Time at which the next byte in flight leaves the ring buffer of a
+// direction, or a held frame is released. Returns FALSE if there is none.
+int next_delivery(struct direction *d, struct timespec *t)
+{
+    int found = FALSE;
+    for (long k = 0; k < d->bufSize - 1; ++k)
+    {
+        if (d->valid[ring_out(d, k)])
+        {
+            *t = slot_time(d, d->slotCount + k);
+            found = TRUE;
+            break;
+        }
+    }
+    if (d->fr.heldLen > 0 && d->fr.holdDelay > 0)
+    {
+        struct timespec release = { .tv_sec = d->fr.releaseNsec / 1000000000,
+                                    .tv_nsec = d->fr.releaseNsec % 1000000000 };
+        if (!found || timespec_comp(&release, t) < 0)
+        {
+            *t = release;
         }
+        found = TRUE;
+    }
+    return found;
+}
+
 
-        // Advance indices to next position
-        par.tx2rxIdx = (par.tx2rxIdx + 1) % par.bufSize;
-        par.rx2txIdx = (par.rx2txIdx + 1) % par.bufSize;
+// Virtual time: instead of sleeping until the next batch, move the link's
+// clock there whenever waiting would only let time pass
+void virtual_time_step(struct link *link)
+{
+    struct parameters *par = &link->par;
+    struct timespec deadline;
 
-        if (par.cableOn)
+    if (input_pending(link))
+    {
+        // The endpoints are producing data: the next batch is due now
+        deadline = next_batch(link);
+        link->waitingGrace = FALSE;
+    }
+    else if (link->waitingGrace)
+    {
+        // Nothing new since the grace period started: jump to the next
+        // byte leaving the ring buffers
+        struct timespec rx2tx;
+        int tx2rxBusy = next_delivery(&par->tx2rx, &deadline);
+        int rx2txBusy = next_delivery(&par->rx2tx, &rx2tx);
+        if (!tx2rxBusy || (rx2txBusy && timespec_comp(&rx2tx, &deadline) < 0))
         {
-            if (par.tx2rxValid[par.tx2rxIdx])
-            {
-                // Add error, if applicable
-                if (par.byteER != 0.0 && (double) rand() / (double) RAND_MAX < par.byteER)
-                {
-                    // At most one wrong bit per byte, good enough if ber < 0.02
-                    par.tx2rx[par.tx2rxIdx] ^= (char) 1 << rand() % 8;
-                }
-                write(fdRx, par.tx2rx + par.tx2rxIdx, 1);
-            }
+            deadline = rx2tx;
+        }
+        if (!tx2rxBusy && !rx2txBusy)
+        {
+            link_now(par, &deadline);
+        }
+        link->waitingGrace = FALSE;
+    }
+    else
+    {
+        // Give the endpoints time to react to the bytes just delivered,
+        // waking up at once if they write something
+        link_now(par, &deadline);
+        struct timespec grace = { .tv_sec = par->graceDelay / 1000000,
+                                  .tv_nsec = par->graceDelay % 1000000 * 1000 };
+        deadline = timespec_sum(&deadline, &grace);
+        watch_ports(link, TRUE);
+        link->waitingGrace = TRUE;
+        arm_timer(link, &deadline);
+        return;
+    }
+    advance_clock(par, &deadline);
+    watch_ports(link, FALSE);
+    arm_timer(link, &deadline);
+}
+
+
+// Forward the traffic of a link after one of its events, and decide what
+// to wait for next
+void service_link(struct link *link)
+{
+    struct parameters *par = &link->par;
+
+    pthread_mutex_lock(&link->lock);
+    if (link->active == FALSE)
+    {
+        // Leaving the idle state: byte slots start now
+        link_now(par, &par->tx2rx.slotEpoch);
+        par->rx2tx.slotEpoch = par->tx2rx.slotEpoch;
+        par->tx2rx.slotCount = 0;
+        par->rx2tx.slotCount = 0;
+        watch_ports(link, FALSE);
+        link->active = TRUE;
+    }
+
+    struct timespec event;
+    if ((link->nStations > 0 ? forward_bus(link) : forward(link)) == FALSE)
+    {
+        // Only a timed scenario event wakes up an idle link
+        arm_timer(link, scenario_wakeup(par, &event) ? &event : NULL);
+        watch_ports(link, TRUE);
+        link->active = FALSE;
+        link->waitingGrace = FALSE;
+    }
+    else if (par->virtualTime)
+    {
+        virtual_time_step(link);
+    }
+    else
+    {
+        // Wake up when the last slot of the next batch is due
+        struct timespec nextWake = next_batch(link);
+        watch_ports(link, FALSE);
+        arm_timer(link, &nextWake);
+    }
+    pthread_mutex_unlock(&link->lock);
+}
+
+
+// Worker thread: wait for traffic or for the timers of its links.
+// The timer of a link only runs while it is forwarding, so idle links cost
+// nothing and wake up as soon as one of their sides writes something.
+void *worker_thread(void *arg)
+{
+    struct worker *w = arg;
+
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(w->cpu, &cpus);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+    {
+        fprintf(stderr, "Could not pin worker %d to CPU %d\n", w->id, w->cpu);
+    }
 
-            if (par.rx2txValid[par.rx2txIdx])
+    struct epoll_event events[64];
+    while (!atomic_load(&stopping))
+    {
+        int nEvents = epoll_wait(w->epfd, events, 64, -1);
+        if (nEvents < 0)
+        {
+            if (errno == EINTR)
             {
-                // Add error, if applicable
-                if (par.byteER != 0.0 && (double) rand() / (double) RAND_MAX < par.byteER)
-                {
-                    // At most one wrong bit per byte, good enough if ber < 0.02
-                    par.rx2tx[par.rx2txIdx] ^= (char) 1 << rand() % 8;
-                }
-                write(fdTx, par.rx2tx + par.rx2txIdx, 1);
+                continue;
             }
+            perror("epoll_wait");
+            break;
         }
 
-        if (par.logfile != NULL)  // Currently logging
+        for (int i = 0; i < nEvents; ++i)
         {
-            if (par.tx2rxValid[par.tx2rxIdx])
-            {
-                sprintf(tx2rxRx, "%02hhX", par.tx2rx[par.tx2rxIdx]);
-            }
-            else
+            uint64_t data = events[i].data.u64;
+            uint64_t expirations;
+            if (EV_KIND(data) == EV_WAKE)
             {
-                memcpy(tx2rxRx, "  ", 3);
+                read(w->wakeFd, &expirations, sizeof(expirations));
+                continue;
             }
-            if (par.rx2txValid[par.rx2txIdx])
+            struct link *link = w->links[EV_LINK(data)];
+            if (EV_KIND(data) == EV_TIMER)
             {
-                sprintf(rx2txRx, "%02hhX", par.rx2tx[par.rx2txIdx]);
+                read(link->timerFd, &expirations, sizeof(expirations));
             }
-            else
+            link->ready = TRUE;
+        }
+
+        for (int i = 0; i < w->nLinks; ++i)
+        {
+            if (w->links[i]->ready)
             {
-                memcpy(rx2txRx, "  ", 3);
+                w->links[i]->ready = FALSE;
+                service_link(w->links[i]);
             }
+        }
+    }
+    return NULL;
+}
+
+
+// Link "<port>.clock" to the clock file, replacing only an old link
+void link_clock(const char *clockFile, const char *port)
+{
+    char name[MAX_DEV_NAME + sizeof(CABLE_CLOCK_SUFFIX)];
+    snprintf(name, sizeof(name), "%s%s", port, CABLE_CLOCK_SUFFIX);
+    struct stat st;
+    if (lstat(name, &st) == 0 && S_ISLNK(st.st_mode))
+    {
+        unlink(name);
+    }
+    symlink(clockFile, name);
+}
+
+
+// Remove "<port>.clock", if it still links to our clock file
+void unlink_clock(const char *clockFile, const char *port)
+{
+    char name[MAX_DEV_NAME + sizeof(CABLE_CLOCK_SUFFIX)];
+    char target[MAX_DEV_NAME + 32];
+    snprintf(name, sizeof(name), "%s%s", port, CABLE_CLOCK_SUFFIX);
+    ssize_t len = readlink(name, target, sizeof(target) - 1);
+    if (len >= 0)
+    {
+        target[len] = '\0';
+        if (strcmp(target, clockFile) == 0)
+        {
+            unlink(name);
+        }
+    }
+}
+
+
+// Create the shared clock of a link. Without it the link still works, but
+// the endpoints cannot follow virtual time. The file is named after this
+// process too, so that cables running at once each have their own; one
+// left with our name by an earlier process that had our pid is replaced.
+void open_clock(struct link *link)
+{
+    struct parameters *par = &link->par;
+    snprintf(link->clockFile, sizeof(link->clockFile), CLOCK_DIR "cable-%d-%d%s",
+             (int) getpid(), link->id, CABLE_CLOCK_SUFFIX);
+    unlink(link->clockFile);
+    int fd = open(link->clockFile, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd >= 0 && ftruncate(fd, sizeof(struct cable_clock)) == 0)
+    {
+        par->clock = mmap(NULL, sizeof(struct cable_clock), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (fd < 0 || par->clock == MAP_FAILED || par->clock == NULL)
+    {
+        fprintf(stderr, "Could not create %s, link clock not shared\n", link->clockFile);
+        link->clockFile[0] = '\0';
+        par->clock = mmap(NULL, sizeof(struct cable_clock), PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    }
+    else
+    {
+        link_clock(link->clockFile, link->txDev);
+        link_clock(link->clockFile, link->rxDev);
+        for (int k = 2; k < link->nStations; ++k)
+        {
+            link_clock(link->clockFile, link->busDev[k]);
+        }
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+}
+
+
+void close_clock(struct link *link)
+{
+    munmap(link->par.clock, sizeof(struct cable_clock));
+    if (link->clockFile[0] != '\0')
+    {
+        unlink_clock(link->clockFile, link->txDev);
+        unlink_clock(link->clockFile, link->rxDev);
+        for (int k = 2; k < link->nStations; ++k)
+        {
+            unlink_clock(link->clockFile, link->busDev[k]);
+        }
+        unlink(link->clockFile);
+    }
+}
 
-            if (*tx2rxTx == ' ' && *rx2txTx == ' ' && *tx2rxRx == ' ' && *rx2txRx == ' ')
+
+// Create the serial ports and the timer of a link.
+// Returns 0 on success, -1 on failure.
+int open_link(struct link *link)
+{
+    link->par = defaultParameters;
+    pthread_mutex_init(&link->lock, NULL);
+
+    link->fdTx = openVirtualPort(link->txDev, &link->slaveTx);
+    if (link->fdTx < 0)
+    {
+        perror(link->txDev);
+        return -1;
+    }
+    link->fdRx = openVirtualPort(link->rxDev, &link->slaveRx);
+    if (link->fdRx < 0)
+    {
+        perror(link->rxDev);
+        closeVirtualPort(link->txDev, link->fdTx, link->slaveTx);
+        return -1;
+    }
+    link->timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (link->timerFd < 0)
+    {
+        perror("timerfd_create");
+        closeVirtualPort(link->txDev, link->fdTx, link->slaveTx);
+        closeVirtualPort(link->rxDev, link->fdRx, link->slaveRx);
+        return -1;
+    }
+    for (int k = 2; k < link->nStations; ++k)
+    {
+        link->busFd[k] = openVirtualPort(link->busDev[k], &link->busSlave[k]);
+        if (link->busFd[k] < 0)
+        {
+            perror(link->busDev[k]);
+            while (--k >= 2)
             {
-                if (cableIdle == FALSE)
-                {
-                    fputs("---------------\n", par.logfile);
-                    cableIdle = TRUE;
-                }
+                closeVirtualPort(link->busDev[k], link->busFd[k], link->busSlave[k]);
             }
-            else
+            close(link->timerFd);
+            closeVirtualPort(link->txDev, link->fdTx, link->slaveTx);
+            closeVirtualPort(link->rxDev, link->fdRx, link->slaveRx);
+            return -1;
+        }
+    }
+    link->watching = TRUE;
+    open_clock(link);
+    return 0;
+}
+
+
+void close_link(struct link *link)
+{
+    struct parameters *par = &link->par;
+    endcapture(par);
+    endanalyze(par);
+    endscenario(par);
+    endlog(par);
+    close(link->timerFd);
+    close_clock(link);
+    closeVirtualPort(link->txDev, link->fdTx, link->slaveTx);
+    closeVirtualPort(link->rxDev, link->fdRx, link->slaveRx);
+    for (int k = 2; k < link->nStations; ++k)
+    {
+        closeVirtualPort(link->busDev[k], link->busFd[k], link->busSlave[k]);
+    }
+    free(par->tx2rx.ring);
+    free(par->tx2rx.valid);
+    free(par->tx2rx.senders);
+    free(par->rx2tx.ring);
+    free(par->rx2tx.valid);
+    free(par->rx2tx.senders);
+    pthread_mutex_destroy(&link->lock);
+}
+
+
+// Create a worker's event loop and register the links assigned to it.
+// Returns 0 on success, -1 on failure.
+int init_worker(struct worker *w)
+{
+    w->epfd = epoll_create1(0);
+    w->wakeFd = eventfd(0, EFD_NONBLOCK);
+    if (w->epfd < 0 || w->wakeFd < 0)
+    {
+        perror("Creating worker event loop");
+        return -1;
+    }
+    struct epoll_event ev = { .events = EPOLLIN, .data.u64 = EV_DATA(0, EV_WAKE) };
+    epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->wakeFd, &ev);
+
+    for (int i = 0; i < w->nLinks; ++i)
+    {
+        struct link *link = w->links[i];
+        int fds[MAX_STATIONS + 1] = { link->fdTx, link->fdRx, link->timerFd };
+        int kinds[MAX_STATIONS + 1] = { EV_TX, EV_RX, EV_TIMER };
+        int nFds = 3;
+        for (int k = 2; k < link->nStations; ++k, ++nFds)
+        {
+            // Secondaries all count as the receiver side
+            fds[nFds] = link->busFd[k];
+            kinds[nFds] = EV_RX;
+        }
+        for (int j = 0; j < nFds; ++j)
+        {
+            ev.data.u64 = EV_DATA(i, kinds[j]);
+            if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, fds[j], &ev) == -1)
             {
-                fprintf(par.logfile, "%s  %s | %s  %s\n", tx2rxTx, tx2rxRx, rx2txTx, rx2txRx);
-                cableIdle = FALSE;
+                perror("epoll_ctl");
+                return -1;
             }
         }
+    }
+    return 0;
+}
 
-        // Read commands from STDIN to control the cable mode
-        int fromStdin = read(STDIN_FILENO, rxStdin, BUF_SIZE);
-        if (fromStdin > 0)
-        {
-            rxStdin[fromStdin - 1] = '\0';
 
-            if (strcmp(rxStdin, "off") == 0)
-            {
-                printf("CONNECTION OFF\n");
-                if (par.cableOn && par.logfile != NULL)
+void usage(const char *program)
+{
+    printf("Usage: %s [-n <links>] [-l <txdev>,<rxdev>]... [-b <ports>]... [-w <workers>]\n"
+           "          [-s <scenario>]\n"
+           "  -n <links>         : emulate <links> cables, link n on " DEV_PREFIX "%d+2n\n"
+           "                       and " DEV_PREFIX "%d+2n (default=1)\n"
+           "  -l <txdev>,<rxdev> : add a link with the given ports (may be repeated)\n"
+           "  -b <primary>,<secondary>[,<secondary>]...\n"
+           "                     : add a bus shared by a primary and up to %d secondaries\n"
+           "  -w <workers>       : threads serving the links, each one pinned to a CPU\n"
+           "                       (default=one per link, at most one per CPU)\n"
+           "  -s <scenario>      : load a scenario file on every link, see help\n",
+           program, FIRST_DEV_NUMBER, FIRST_DEV_NUMBER + 1, MAX_STATIONS - 1);
+}
+
+
+int main(int argc, char *argv[])
+{
+    // Links and workers from the command line
+    int opt;
+    int defaultLinks = 0;
+    const char *scenarioFile = NULL;
+    while ((opt = getopt(argc, argv, "n:l:b:w:s:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'n':
+                defaultLinks = atoi(optarg);
+                if (defaultLinks < 1 || nLinks + defaultLinks > MAX_LINKS)
                 {
-                    fputs("CABLE OFF\n", par.logfile);
+                    fprintf(stderr, "Number of links must be between 1 and %d\n", MAX_LINKS);
+                    exit(1);
                 }
-                par.cableOn = FALSE;
-            }
-            else if (strcmp(rxStdin, "on") == 0)
+                for (int i = 0; i < defaultLinks; ++i)
+                {
+                    snprintf(links[nLinks].txDev, MAX_DEV_NAME, DEV_PREFIX "%d", FIRST_DEV_NUMBER + 2 * i);
+                    snprintf(links[nLinks].rxDev, MAX_DEV_NAME, DEV_PREFIX "%d", FIRST_DEV_NUMBER + 2 * i + 1);
+                    ++nLinks;
+                }
+                break;
+            case 'l':
             {
-                printf("CONNECTION ON\n");
-                par.cableOn = TRUE;
+                const char *comma = strchr(optarg, ',');
+                if (comma == NULL || comma == optarg || comma[1] == '\0'
+                    || comma - optarg >= MAX_DEV_NAME || strlen(comma + 1) >= MAX_DEV_NAME
+                    || nLinks == MAX_LINKS)
+                {
+                    fprintf(stderr, "Bad link %s, expected <txdev>,<rxdev>\n", optarg);
+                    exit(1);
+                }
+                memcpy(links[nLinks].txDev, optarg, comma - optarg);
+                links[nLinks].txDev[comma - optarg] = '\0';
+                strcpy(links[nLinks].rxDev, comma + 1);
+                ++nLinks;
+                break;
             }
-            else if (strncmp(rxStdin, "ber ", 4) == 0)
+            case 'b':
             {
-                double ber;
-                sscanf(rxStdin + 4, "%lf", &ber);
-                // Compute pow(1 - ber, 8) without libm
-                double acc = 1 - ber;
-                acc *= acc;   // Squared
-                acc *= acc;   // To the fourth
-                acc *= acc;   // To the eightth
-                par.byteER = 1.0 - acc;
-                //printf("Byte Error Rate is %lf\n", par.byteER);
-                if (ber >= 0.0 && ber < 1.0)
+                // Primary, then secondaries, comma separated
+                struct link *link = &links[nLinks];
+                int k = 0;
+                for (char *port = strtok(optarg, ","); port != NULL; port = strtok(NULL, ","), ++k)
                 {
-                    printf("BER SET TO %lf\n", ber);
-                    if (ber > 0.01)
+                    if (k == MAX_STATIONS || strlen(port) >= MAX_DEV_NAME)
                     {
-                        printf("   ACTUAL BER WILL BE LOWER THAN DEFINED FOR VALUES ABOVE 0.01\n");
+                        k = MAX_STATIONS + 1;
+                        break;
                     }
+                    strcpy(k == 0 ? link->txDev : k == 1 ? link->rxDev : link->busDev[k], port);
                 }
-                else
+                if (k < 2 || k > MAX_STATIONS || nLinks == MAX_LINKS)
                 {
-                    printf("BAD BER VALUE %lf (MUST BE 0 <= BER < 1.0)", ber);
-                }
-            }
-            else if (strncmp(rxStdin, "baud ", 5) == 0)
-            {
-                unsigned long baud = 0;
-                sscanf(rxStdin + 5, "%lu", &baud);
-                switch (baud) {
-                    case 1200:
-                    case 1800:
-                    case 2400:
-                    case 4800:
-                    case 9600:
-                    case 19200:
-                    case 38400:
-                    case 57600:
-                    case 115200:
-                        set_baud_rate(baud);
-                        break;
-                    default:
-                        printf("UNSUPPORTED BAUD RATE: must be one of 1200, 1800, 2400, 4800, 9600, 19200, 38400, 57600 or 115200\n");
+                    fprintf(stderr, "Bad bus, expected <primary>,<secondary>[,<secondary>]..., at most %d ports\n",
+                            MAX_STATIONS);
+                    exit(1);
                 }
+                link->nStations = k;
+                ++nLinks;
+                break;
             }
-            else if (strncmp(rxStdin, "prop ", 5) == 0)
-            {
-                unsigned long propDelay;
-                if (sscanf(rxStdin + 5, "%lu", &propDelay) < 1 || propDelay > 1000000)
-                {
-                    printf("BAD OR OUT OF RANGE PROPAGATION DELAY\n");
-                }
-                else
+            case 's':
+                scenarioFile = optarg;
+                break;
+            case 'w':
+                nWorkers = atoi(optarg);
+                if (nWorkers < 1)
                 {
-                    par.propDelay = propDelay;
-                    init_ring_buffers();
+                    fprintf(stderr, "Number of workers must be at least 1\n");
+                    exit(1);
                 }
-            }
-            else if (strncmp(rxStdin, "log ", 4) == 0)
+                break;
+            default:
+                usage(argv[0]);
+                exit(opt == 'h' ? 0 : 1);
+        }
+    }
+    if (nLinks == 0)
+    {
+        strcpy(links[0].txDev, TXDEV);
+        strcpy(links[0].rxDev, RXDEV);
+        nLinks = 1;
+    }
+    int nCpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nCpus < 1)
+    {
+        nCpus = 1;
+    }
+    if (nWorkers == 0)
+    {
+        nWorkers = nLinks < nCpus ? nLinks : nCpus;
+    }
+    if (nWorkers > nLinks)
+    {
+        nWorkers = nLinks;
+    }
+
+    printf("\n");
+
+    // Create the serial ports
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    unsigned long long seed = now.tv_sec * 1000000000ULL + now.tv_nsec;
+
+    for (int i = 0; i < nLinks; ++i)
+    {
+        links[i].id = i;
+        if (open_link(&links[i]) < 0)
+        {
+            while (--i >= 0)
             {
-                startlog(rxStdin + 4);
+                close_link(&links[i]);
             }
-            else if (strcmp(rxStdin, "endlog") == 0)
+            exit(-1);
+        }
+        set_baud_rate(&links[i].par, &links[i].par.tx2rx, DEFAULT_BAUDRATE);
+        set_baud_rate(&links[i].par, &links[i].par.rx2tx, DEFAULT_BAUDRATE);
+        seed_channels(&links[i].par, seed + i);
+        if (scenarioFile != NULL)
+        {
+            startscenario(&links[i].par, scenarioFile);
+        }
+    }
+    printf("SEED: %llu%s\n", seed, nLinks > 1 ? " (PLUS THE LINK NUMBER)" : "");
+
+    // Shard the links over the workers
+    workers = calloc(nWorkers, sizeof(*workers));
+    if (workers == NULL)
+    {
+        perror("calloc");
+        exit(-1);
+    }
+    for (int i = 0; i < nLinks; ++i)
+    {
+        struct worker *w = &workers[i % nWorkers];
+        links[i].worker = w;
+        links[i].index = w->nLinks;
+        w->links[w->nLinks++] = &links[i];
+    }
+
+    // Signals are handled by the main thread only
+    sigset_t allSignals, oldMask;
+    sigfillset(&allSignals);
+    pthread_sigmask(SIG_BLOCK, &allSignals, &oldMask);
+    for (int i = 0; i < nWorkers; ++i)
+    {
+        workers[i].id = i;
+        workers[i].cpu = i % nCpus;
+        if (init_worker(&workers[i]) < 0
+            || pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i]) != 0)
+        {
+            fprintf(stderr, "Could not start worker %d\n", i);
+            exit(-1);
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &oldMask, NULL);
+
+    // Remove the ports also when interrupted
+    struct sigaction sa = { .sa_handler = interrupt_handler };
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGHUP, &sa, NULL);
+
+    help();
+
+    // Commands are read with blocking reads
+    int oldf = fcntl(STDIN_FILENO, F_GETFL, 0);
+    fcntl(STDIN_FILENO, F_SETFL, oldf & ~O_NONBLOCK);
+
+    char rxStdin[BUF_SIZE] = {0};
+
+    int STOP = FALSE;
+
+    printf("\nCable ready (%d link%s, %d worker%s)\n\n", nLinks, nLinks > 1 ? "s" : "",
+           nWorkers, nWorkers > 1 ? "s" : "");
+
+    while (STOP == FALSE && interrupted == FALSE)
+    {
+        // Read commands from STDIN to control the cable mode
+        int fromStdin = read(STDIN_FILENO, rxStdin, BUF_SIZE);
+        if (fromStdin > 0)
+        {
+            rxStdin[fromStdin - 1] = '\0';
+            // Several commands may arrive in one read, one per line
+            char *command = rxStdin;
+            while (command != NULL && STOP == FALSE)
             {
-                endlog();
-                printf("NOT LOGGING\n");
+                char *newline = strchr(command, '\n');
+                if (newline != NULL)
+                {
+                    *newline = '\0';
+                }
+                STOP = run_command(command);
+                command = newline != NULL ? newline + 1 : NULL;
             }
-            else if (strcmp(rxStdin, "quit") == 0)
+        }
+        else if (fromStdin == 0)
+        {
+            // No more commands: run until interrupted
+            while (interrupted == FALSE)
             {
-                printf("END OF THE PROGRAM\n");
-                STOP = TRUE;
-            }
-            else if (strcmp(rxStdin, "help") == 0) {
-                help();
-            }
-            else {
-                printf("BAD COMMAND OR MISSING PARAMETERS\n");
+                pause();
             }
         }
-
-        if (skipWait == FALSE) {
-            nanosleep(&nextWait, NULL);
+        else if (errno != EINTR)
+        {
+            perror("read");
+            break;
         }
     }
 
-    // Restore the old port settings
-    if (tcsetattr(fdRx, TCSANOW, &oldtioRx) == -1)
+    // Stop the workers, then remove the ports
+    atomic_store(&stopping, TRUE);
+    for (int i = 0; i < nWorkers; ++i)
     {
-        perror("tcsetattr");
-        exit(-1);
+        uint64_t one = 1;
+        write(workers[i].wakeFd, &one, sizeof(one));
     }
-
-    if (tcsetattr(fdTx, TCSANOW, &oldtioTx) == -1)
+    for (int i = 0; i < nWorkers; ++i)
     {
-        perror("tcsetattr");
-        exit(-1);
+        pthread_join(workers[i].thread, NULL);
+        close(workers[i].epfd);
+        close(workers[i].wakeFd);
     }
+    free(workers);
 
-    close(fdTx);
-    close(fdRx);
-
-    system("killall socat");
+    for (int i = 0; i < nLinks; ++i)
+    {
+        close_link(&links[i]);
+    }
 
     return 0;
 }
@@ -0,0 +1,43 @@
+// cable_clock.c
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "cable_clock.h"
+
+const struct cable_clock *cable_clock_open(const char *serialPort){
+
+    char path[256];
+    snprintf(path, sizeof(path), "%s%s", serialPort, CABLE_CLOCK_SUFFIX);
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    void *clock = mmap(NULL, sizeof(struct cable_clock), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (clock == MAP_FAILED)
+        return NULL;
+
+    return clock;
+}
+
+void cable_clock_gettime(const struct cable_clock *clock, struct timespec *t){
+
+    clock_gettime(CLOCK_MONOTONIC, t);
+
+    if (clock == NULL)
+        return;
+
+    int64_t nsec = t->tv_nsec + __atomic_load_n(&clock->offset, __ATOMIC_ACQUIRE);
+    t->tv_sec += nsec / 1000000000;
+    t->tv_nsec = nsec % 1000000000;
+}
+
+void cable_clock_close(const struct cable_clock *clock){
+
+    if (clock != NULL)
+        munmap((void *) clock, sizeof(struct cable_clock));
+}
@@ -0,0 +1,32 @@
+// cable_clock.h
+//
+// Clock of the virtual cable, shared with the programs using its ports.
+// In virtual-time mode the cable moves its time ahead of the wall clock
+// whenever the link only has to wait for bytes in flight, and publishes how
+// far ahead in a file next to each serial port ("<port>.clock"). Programs on
+// the cable should take their timeouts from this clock, so that they see the
+// same time as the link.
+
+#ifndef CABLE_CLOCK_H
+#define CABLE_CLOCK_H
+
+#include <stdint.h>
+#include <time.h>
+
+#define CABLE_CLOCK_SUFFIX ".clock"
+
+// Contents of the clock file: the link's time is CLOCK_MONOTONIC + offset
+struct cable_clock {
+    int64_t offset;   // nsec, only ever increases
+};
+
+// Map the clock of the cable serving "serialPort".
+// Returns NULL if there is none (e.g. on a real serial port).
+const struct cable_clock *cable_clock_open(const char *serialPort);
+
+// Current time on the link; CLOCK_MONOTONIC if "clock" is NULL
+void cable_clock_gettime(const struct cable_clock *clock, struct timespec *t);
+
+void cable_clock_close(const struct cable_clock *clock);
+
+#endif
@@ -0,0 +1,142 @@
+// fcs.c
+#include <string.h>
+#include "fcs.h"
+
+#define FALSE 0
+#define TRUE 1
+
+// Reversed generator polynomials
+#define POLY_CRC16 0x8408      // x^16 + x^12 + x^5 + 1
+#define POLY_CRC32 0xEDB88320  // x^32 + x^26 + x^23 + ... + x + 1
+
+// State after a block followed by its FCS
+#define RESIDUE_CRC16 0xF0B8
+#define RESIDUE_CRC32 0xDEBB20E3
+
+// table[t][k][b]: CRC of byte "b" followed by "k" zero bytes, for the
+// CRC-16 (t = 0) and the CRC-32 (t = 1)
+static uint32_t table[2][8][256];
+static int tablesBuilt = FALSE;
+
+static void build_tables(void){
+
+    const uint32_t poly[2] = { POLY_CRC16, POLY_CRC32 };
+
+    for (int t = 0; t < 2; t++){
+
+        for (int b = 0; b < 256; b++){
+
+            uint32_t c = b;
+
+            for (int bit = 0; bit < 8; bit++)
+                c = c & 1 ? (c >> 1) ^ poly[t] : c >> 1;
+
+            table[t][0][b] = c;
+        }
+
+        for (int k = 1; k < 8; k++)
+            for (int b = 0; b < 256; b++)
+                table[t][k][b] = (table[t][k - 1][b] >> 8) ^ table[t][0][table[t][k - 1][b] & 0xFF];
+    }
+
+    tablesBuilt = TRUE;
+}
+
+static uint32_t load_le32(const unsigned char *p){
+
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+// Slicing-by-8: the state is folded into the next eight bytes, and each
+// of them goes through the table for its distance to the end
+static uint32_t crc(const uint32_t t[8][256], uint32_t c, const unsigned char *p, size_t n){
+
+    for (; n >= 8; p += 8, n -= 8){
+
+        uint32_t lo = load_le32(p) ^ c;
+        uint32_t hi = load_le32(p + 4);
+
+        c = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^ t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24]
+            ^ t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF] ^ t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+    }
+
+    for (; n > 0; p++, n--)
+        c = (c >> 8) ^ t[0][(c ^ *p) & 0xFF];
+
+    return c;
+}
+
+// XOR of a block, eight bytes at a time
+static uint32_t bcc2(uint32_t x, const unsigned char *p, size_t n){
+
+    uint64_t acc = 0;
+    size_t k = 0;
+
+    for (; k + 8 <= n; k += 8){
+
+        uint64_t w;
+        memcpy(&w, p + k, 8);
+        acc ^= w;
+    }
+
+    acc ^= acc >> 32;
+    acc ^= acc >> 16;
+    acc ^= acc >> 8;
+    x ^= acc & 0xFF;
+
+    for (; k < n; k++)
+        x ^= p[k];
+
+    return x;
+}
+
+size_t fcs_size(int type){
+
+    return type == FCS_CRC32 ? 4 : type == FCS_CRC16 ? 2 : 1;
+}
+
+uint32_t fcs_start(int type){
+
+    return type == FCS_CRC32 ? 0xFFFFFFFF : type == FCS_CRC16 ? 0xFFFF : 0;
+}
+
+uint32_t fcs_update(int type, uint32_t fcs, const unsigned char *p, size_t n){
+
+    if (type == FCS_BCC2)
+        return bcc2(fcs, p, n);
+
+    if (!tablesBuilt)
+        build_tables();
+
+    return crc(table[type == FCS_CRC32], fcs, p, n);
+}
+
+size_t fcs_put(int type, uint32_t fcs, unsigned char *out){
+
+    size_t size = fcs_size(type);
+
+    // The CRCs are sent inverted
+    if (type != FCS_BCC2)
+        fcs = ~fcs;
+
+    for (size_t k = 0; k < size; k++)
+        out[k] = fcs >> (8 * k);
+
+    return size;
+}
+
+int fcs_check(int type, uint32_t fcs){
+
+    switch (type){
+
+        case FCS_CRC16:
+            return fcs == RESIDUE_CRC16;
+
+        case FCS_CRC32:
+            return fcs == RESIDUE_CRC32;
+
+        default:
+            // The XOR of a block and its XOR
+            return fcs == 0;
+    }
+}
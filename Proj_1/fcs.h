@@ -0,0 +1,37 @@
+// fcs.h
+//
+// Frame check sequences: the 8-bit XOR of the bytes (BCC2), CRC-16-CCITT
+// as in HDLC and CRC-32 as in Ethernet. The CRCs are LSB first and sent
+// least significant byte first, so that the CRC of a block followed by
+// its FCS is a constant: a frame is checked in one pass over the data and
+// the FCS, as the bytes arrive, without knowing in advance where it ends.
+// They are computed eight bytes at a time with slicing-by-8 tables.
+
+#ifndef FCS_H
+#define FCS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FCS_BCC2 0
+#define FCS_CRC16 1
+#define FCS_CRC32 2
+
+#define FCS_MAX 4  // Bytes of the longest FCS
+
+// Bytes of the FCS of type "type"
+size_t fcs_size(int type);
+
+// State before the first byte
+uint32_t fcs_start(int type);
+
+// Add "n" bytes to the state "fcs". A block may be added in pieces.
+uint32_t fcs_update(int type, uint32_t fcs, const unsigned char *p, size_t n);
+
+// Write the FCS for the state "fcs" to "out". Returns its size.
+size_t fcs_put(int type, uint32_t fcs, unsigned char *out);
+
+// TRUE if "fcs" is the state after a block followed by its FCS
+int fcs_check(int type, uint32_t fcs);
+
+#endif
@@ -0,0 +1,1156 @@
+// link_layer.c
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include "cable_clock.h"
+#include "fcs.h"
+#include "link_layer.h"
+#include "stuffing.h"
+
+#define FALSE 0
+#define TRUE 1
+
+#define A_TX 0x03  // Commands sent by the transmitter, replies by the receiver
+#define A_RX 0x01  // Commands sent by the receiver, replies by the transmitter
+
+#define C_SET 0x03
+#define C_UA 0x07
+#define C_DISC 0x0B
+// Sequence numbers modulo 16 in the high nibble of the control field: Ns of
+// an I-frame, Nr (next Ns expected) of RR and REJ, Ns asked for by SREJ
+#define SEQ_MODULUS 16
+#define C_I(ns) ((ns) << 4)
+#define C_RR(nr) (0x05 | ((nr) << 4))
+#define C_REJ(nr) (0x01 | ((nr) << 4))
+#define C_SREJ(nr) (0x0D | ((nr) << 4))
+#define IS_I(c) (((c) & 0x0F) == 0x00)
+#define IS_RR(c) (((c) & 0x0F) == 0x05)
+#define IS_REJ(c) (((c) & 0x0F) == 0x01)
+#define IS_SREJ(c) (((c) & 0x0F) == 0x0D)
+#define C_SEQ(c) ((c) >> 4)
+#define SEQ_DIST(from, to) (((to) - (from)) & (SEQ_MODULUS - 1))
+
+// Parameters negotiated in the information field of SET and UA, as type,
+// length and value (big-endian). A peer that sends none gets the defaults.
+#define TLV_WINDOW 0x01
+#define TLV_ARQ 0x02     // 1 for Selective Repeat, 0 (default) for Go-Back-N
+#define TLV_FCS 0x03     // FCS of the I-frames, FCS_BCC2 by default (the LL_FCS_...
+                         // values are those of fcs.h)
+#define TLV_PAYLOAD 0x04 // Largest payload of an I-frame, LL_MAX_PAYLOAD by default
+#define INFO_MAX 16
+
+// Longest frame on the line: every byte between the flags may be escaped
+#define FRAME_MAX (2 + STUFFED_MAX(3 + LL_MAX_PAYLOAD + FCS_MAX))
+
+#define RX_CHUNK 4096  // Bytes read from the serial port at once
+
+// Inside an I-frame, the receiver sleeps while about the rest of it arrives,
+// at the pace measured on it so far (after PACE_MIN bytes) and taking it to
+// be as long as the last one, then reads what came, rather than wake up for
+// each byte. Each sleep lasts at most PACE_CHUNK bytes and PACE_MAX, so that
+// a frame shorter than the last is seen to end soon after. Escapes make
+// frames of the same payload differ a little, so it aims 1/SLACK short; the
+// rest it waits for with poll().
+#define SLACK 64
+#define PACE_MIN 64
+#define PACE_CHUNK 256
+#define PACE_MAX (10 * 1000000LL)  // nsec
+
+// The payload size follows the I-frames lost (REJ, SREJ, or timeout once
+// the round trip time is known) per byte sent, both decayed on each I-frame
+// sent, so that about the last 64 count
+#define PAYLOAD_MIN 64
+#define QUALITY_DECAY (63.0 / 64)
+
+// Retransmission timeout, from the round trip time as in RFC 6298:
+// ll_params.timeout until the first sample, doubled on each timeout.
+// Only I-frames are sampled, as the time to send them is part of it.
+#define NSEC_PER_SEC 1000000000LL
+#define RTO_MIN (10 * 1000000LL)         // nsec
+#define RTO_MAX (60 * NSEC_PER_SEC)
+#define RTO_GRANULARITY 1000000LL        // poll() waits in msec
+#define NO_DEADLINE INT64_MAX
+#define CLOCK_SLICE_MSEC 10  // Longest wait on the cable's clock, which may
+                             // jump ahead
+
+struct ll_connection {
+
+    int fd;
+    struct termios oldtio;
+    struct ll_params params;
+    const struct cable_clock *clock;  // NULL on a real serial port
+
+    int window;             // I-frames in flight, as negotiated
+    int selective;          // TRUE for Selective Repeat, as negotiated
+    int fcs;                // FCS of the I-frames, as negotiated; the other
+                            // frames always have a BCC2
+    size_t maxPayload;      // Largest payload of an I-frame, as negotiated
+
+    // Transmitter: I-frames from "base" to "next" wait for an RR
+    unsigned char base, next;
+    int retries;                 // Retransmissions since the last progress
+    int64_t deadline;            // To send again from "base"
+    int64_t sentAt[SEQ_MODULUS]; // When each frame was first sent
+    unsigned resent;             // Mask of the frames sent again, 1 << Ns,
+                                 // whose RR is no round trip sample (Karn)
+    unsigned char sent[SEQ_MODULUS][FRAME_MAX];  // Frames by Ns, stuffed
+    size_t sentLen[SEQ_MODULUS];
+    int srejs[SEQ_MODULUS];      // Times each frame was asked for with SREJ
+    double lost, lineBytes;      // Recent line quality (see QUALITY_DECAY)
+
+    int64_t srtt, rttvar;   // Round trip time, smoothed, and its variation;
+                            // srtt is 0 until the first sample
+    int64_t rto;            // Retransmission timeout, with the backoff
+
+    // Receiver
+    unsigned char nr;       // Ns of the next I-frame expected
+    int rejSent;            // TRUE after REJ, until the frame asked for arrives
+
+    // Receiver, Selective Repeat: I-frames that arrived after a missing one,
+    // by Ns. Those from "out" to "nr" are acknowledged and wait for llread,
+    // those after "nr" for the frames missing before them.
+    unsigned char out;
+    unsigned held;               // Mask of the slots in use, 1 << Ns
+    unsigned srejSent;           // Mask of the Ns asked for and not received
+    unsigned char slot[SEQ_MODULUS][LL_MAX_PAYLOAD];
+    size_t slotLen[SEQ_MODULUS];
+    int discReceived;       // The transmitter asked to disconnect
+    unsigned char ua[INFO_MAX];  // Information field of the UA sent
+    size_t uaLen;
+
+    unsigned char rx[RX_CHUNK];  // Bytes read and not yet deframed
+    size_t rxPos, rxLen;
+    size_t lastFrame;       // Bytes of the last I-frame after BCC1, stuffed
+    int64_t byteTime;       // Time each took to arrive, nsec
+
+    struct ll_statistics stats;
+};
+
+// Frame received. The payload of an I-frame is written to "data", which has
+// room for "size" bytes; frames with more are discarded. The FCS is checked
+// as the information field is destuffed.
+struct rx_frame {
+
+    unsigned char a, c;
+    unsigned char *data;
+    size_t size;
+    size_t len;
+    int fcsOk;
+    size_t over;            // Bytes of the frame past the end of "data"
+    int fcsType;
+    uint32_t fcs;           // State over the information field so far
+};
+
+typedef enum{
+
+    RX_HUNT,    // Waiting for a flag
+    RX_FLAG,    // Flag seen, the address follows (or more flags)
+    RX_A,
+    RX_C,
+    RX_BCC1,    // Header ok: a flag, or the information field
+    RX_DATA
+
+} rxState;
+
+// Start a frame: flag and stuffed header. Returns its length.
+static size_t frame_header(unsigned char *frame, unsigned char a, unsigned char c){
+
+    unsigned char header[3] = { a, c, a ^ c };
+
+    frame[0] = FLAG;
+    return 1 + stuff(frame + 1, header, sizeof(header));
+}
+
+// Send a control frame, with an information field if "infoLen" > 0
+static int send_control(struct ll_connection *conn, unsigned char a, unsigned char c,
+                        const unsigned char *info, size_t infoLen){
+
+    unsigned char frame[2 + STUFFED_MAX(3 + INFO_MAX + 1)];
+    size_t len = frame_header(frame, a, c);
+
+    if (infoLen > 0){
+
+        unsigned char bcc2;
+
+        fcs_put(FCS_BCC2, fcs_update(FCS_BCC2, fcs_start(FCS_BCC2), info, infoLen), &bcc2);
+        len += stuff(frame + len, info, infoLen);
+        len += stuff(frame + len, &bcc2, 1);
+    }
+    frame[len++] = FLAG;
+
+    conn->stats.framesSent++;
+
+    return write(conn->fd, frame, len) == (ssize_t) len ? 0 : -1;
+}
+
+static int send_supervision(struct ll_connection *conn, unsigned char a, unsigned char c){
+
+    return send_control(conn, a, c, NULL, 0);
+}
+
+// Value of a parameter in an information field, "def" if absent
+static unsigned long tlv_get(const unsigned char *info, size_t len, unsigned char type, unsigned long def){
+
+    for (size_t i = 0; i + 2 <= len && i + 2 + info[i + 1] <= len; i += 2 + info[i + 1]){
+
+        if (info[i] != type)
+            continue;
+
+        unsigned long value = 0;
+
+        for (int k = 0; k < info[i + 1]; k++)
+            value = value << 8 | info[i + 2 + k];
+
+        return value;
+    }
+
+    return def;
+}
+
+// Append a parameter of "size" bytes to an information field
+static size_t tlv_put(unsigned char *info, size_t len, unsigned char type, unsigned long value, int size){
+
+    info[len++] = type;
+    info[len++] = size;
+
+    for (int k = size - 1; k >= 0; k--)
+        info[len++] = value >> (8 * k);
+
+    return len;
+}
+
+// Time on the link, in nsec
+static int64_t link_time(struct ll_connection *conn){
+
+    struct timespec now;
+    cable_clock_gettime(conn->clock, &now);
+
+    return now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+}
+
+static int64_t deadline_after(struct ll_connection *conn){
+
+    return link_time(conn) + conn->rto;
+}
+
+// Jacobson / Karels: the timeout is the smoothed round trip time plus four
+// times its mean deviation. A new sample also ends the backoff.
+static void rtt_sample(struct ll_connection *conn, int64_t rtt){
+
+    if (conn->srtt == 0){
+
+        conn->srtt = rtt;
+        conn->rttvar = rtt / 2;
+    }
+    else{
+
+        int64_t error = conn->srtt > rtt ? conn->srtt - rtt : rtt - conn->srtt;
+
+        conn->rttvar += (error - conn->rttvar) / 4;
+        conn->srtt += (rtt - conn->srtt) / 8;
+    }
+
+    conn->rto = conn->srtt + (4 * conn->rttvar > RTO_GRANULARITY ? 4 * conn->rttvar : RTO_GRANULARITY);
+    conn->rto = conn->rto < RTO_MIN ? RTO_MIN : conn->rto > RTO_MAX ? RTO_MAX : conn->rto;
+}
+
+// After a timeout, wait twice as long (RFC 6298, 5.5), also before the
+// first sample: a frame may take longer than ll_params.timeout on the line,
+// and Karn's rule takes no sample from a frame sent again.
+static void rtt_backoff(struct ll_connection *conn){
+
+    conn->rto = 2 * conn->rto < RTO_MAX ? 2 * conn->rto : RTO_MAX;
+}
+
+// Wait until the serial port has bytes to read or "deadline" passes.
+// Returns 1 if it has, 0 if not, -1 on error.
+static int wait_input(struct ll_connection *conn, int64_t deadline){
+
+    int msec = -1;
+
+    if (deadline != NO_DEADLINE){
+
+        int64_t left = deadline - link_time(conn);
+
+        // Rounded up, so that the deadline has passed on return; once it
+        // has, the port is only checked
+        msec = left > 0 ? (left + RTO_GRANULARITY - 1) / RTO_GRANULARITY : 0;
+
+        if (conn->clock != NULL && msec > CLOCK_SLICE_MSEC)
+            msec = CLOCK_SLICE_MSEC;
+    }
+
+    struct pollfd pfd = { .fd = conn->fd, .events = POLLIN };
+    int res = poll(&pfd, 1, msec);
+
+    if (res < 0)
+        return errno == EINTR ? 0 : -1;
+
+    return res;
+}
+
+// Sleep for "nsec", at most until the deadline
+static void sleep_for(struct ll_connection *conn, int64_t nsec, int64_t deadline){
+
+    int64_t left = deadline - link_time(conn);
+
+    if (nsec > left)
+        nsec = left;
+
+    if (conn->clock != NULL && nsec > CLOCK_SLICE_MSEC * RTO_GRANULARITY)
+        nsec = CLOCK_SLICE_MSEC * RTO_GRANULARITY;
+
+    if (nsec <= 0)
+        return;
+
+    struct timespec ts = { .tv_sec = nsec / NSEC_PER_SEC, .tv_nsec = nsec % NSEC_PER_SEC };
+    nanosleep(&ts, NULL);
+}
+
+// Destuff a run of payload bytes, without flags, into the frame, and add
+// them to its FCS. Once its buffer is full, only the count is kept.
+static void payload_run(struct rx_frame *f, const unsigned char *p, size_t n, int *escaped){
+
+    size_t used = 0;
+
+    // Destuffing never produces more bytes than it consumes
+    while (used < n && f->over == 0 && f->len < f->size){
+
+        size_t fit = n - used < f->size - f->len ? n - used : f->size - f->len;
+        size_t out = destuff(f->data + f->len, p + used, fit, escaped);
+
+        f->fcs = fcs_update(f->fcsType, f->fcs, f->data + f->len, out);
+        f->len += out;
+        used += fit;
+    }
+
+    unsigned char spill[64];
+
+    while (used < n){
+
+        size_t piece = n - used < sizeof(spill) ? n - used : sizeof(spill);
+        size_t out = destuff(spill, p + used, piece, escaped);
+
+        f->fcs = fcs_update(f->fcsType, f->fcs, spill, out);
+        f->over += out;
+        used += piece;
+    }
+}
+
+// Check the FCS of an information field received whole: its last bytes,
+// which may be past the end of the buffer
+static void payload_end(struct rx_frame *f){
+
+    size_t size = fcs_size(f->fcsType);
+
+    if (f->len + f->over < size || f->over > size){
+
+        // Shorter than the FCS, or too long for the buffer
+        f->fcsOk = FALSE;
+        return;
+    }
+
+    f->len -= size - f->over;
+    f->fcsOk = fcs_check(f->fcsType, f->fcs);
+}
+
+// Wait for the next frame with a valid header, until "deadline" (NO_DEADLINE to
+// wait forever). The serial port is read in chunks, most of an I-frame at a
+// time; the header is decoded byte by byte, and the payload of an I-frame is
+// destuffed in runs, up to the next flag, straight into f->data. A frame cut
+// short by the deadline is decoded again on the next call, if it started in
+// the chunk still buffered.
+// Returns 1 if a frame was received, 0 on timeout, -1 on error.
+static int receive_frame(struct ll_connection *conn, struct rx_frame *f, int64_t deadline){
+
+    rxState state = RX_HUNT;
+    size_t frameStart = SIZE_MAX;  // Position of its flag in conn->rx
+    int escaped = FALSE;
+    size_t raw = 0;          // Bytes of the information field so far, stuffed
+    int64_t start = 0;       // When it started
+    int stalled = FALSE;     // Nothing arrived after a sleep
+
+    while (TRUE){
+
+        if (conn->rxPos == conn->rxLen){
+
+            size_t expect = conn->lastFrame - conn->lastFrame / SLACK;
+            int paced = state == RX_DATA && f->size > 0 && !stalled && expect > raw;
+
+            // The frame is still arriving, so this is its pace
+            if (state == RX_DATA && raw >= PACE_MIN)
+                conn->byteTime = (link_time(conn) - start) / raw;
+
+            if (paced){
+
+                // Part of the rest of the frame, if as long as the last one
+                size_t rest = expect - raw < PACE_CHUNK ? expect - raw : PACE_CHUNK;
+                int64_t nsec = (int64_t) rest * conn->byteTime;
+
+                sleep_for(conn, nsec < PACE_MAX ? nsec : PACE_MAX, deadline);
+            }
+            else{
+
+                int res = wait_input(conn, deadline);
+
+                if (res < 0)
+                    return -1;
+
+                if (res == 0){
+
+                    // Nothing yet: the deadline may not have passed on the
+                    // cable's clock, or poll() was interrupted
+                    if (deadline != NO_DEADLINE && link_time(conn) >= deadline){
+
+                        if (state != RX_HUNT && frameStart != SIZE_MAX)
+                            conn->rxPos = frameStart;
+
+                        return 0;
+                    }
+
+                    continue;
+                }
+            }
+
+            int res = read(conn->fd, conn->rx, sizeof(conn->rx));
+
+            if (res < 0 || (res == 0 && !paced))
+                return -1;
+
+            if (res == 0){
+
+                // A frame shorter than the last, or a line gone quiet
+                stalled = TRUE;
+                continue;
+            }
+
+            conn->rxPos = 0;
+            conn->rxLen = res;
+            frameStart = SIZE_MAX;
+            continue;
+        }
+
+        const unsigned char *p = conn->rx + conn->rxPos;
+        size_t n = conn->rxLen - conn->rxPos;
+
+        if (state == RX_DATA && *p != FLAG){
+
+            size_t run = find_flag(p, n);
+            payload_run(f, p, run, &escaped);
+            conn->rxPos += run;
+            raw += run;
+            continue;
+        }
+
+        unsigned char byte = *p;
+        conn->rxPos++;
+
+        if (byte == FLAG){
+
+            if (state == RX_BCC1){
+
+                // Supervision frame
+                f->len = 0;
+                f->fcsOk = TRUE;
+                return 1;
+            }
+
+            if (state == RX_DATA && !escaped){
+
+                if (f->size > 0)
+                    conn->lastFrame = raw;
+
+                payload_end(f);
+                return 1;
+            }
+
+            // Start of a frame, or a broken one
+            state = RX_FLAG;
+            frameStart = conn->rxPos - 1;
+            escaped = FALSE;
+            continue;
+        }
+
+        if (state == RX_HUNT)
+            continue;
+
+        if (byte == ESC && state != RX_BCC1){
+
+            escaped = TRUE;
+            continue;
+        }
+
+        if (escaped){
+
+            byte ^= ESC_XOR;
+            escaped = FALSE;
+        }
+
+        switch (state){
+
+            case RX_FLAG:
+
+                f->a = byte;
+                state = RX_A;
+                break;
+
+            case RX_A:
+
+                f->c = byte;
+                state = RX_C;
+                break;
+
+            case RX_C:
+
+                state = byte == (f->a ^ f->c) ? RX_BCC1 : RX_HUNT;
+                break;
+
+            case RX_BCC1:
+
+                // The information field starts with this byte
+                f->len = 0;
+                f->over = 0;
+                f->fcsType = IS_I(f->c) ? conn->fcs : FCS_BCC2;
+                f->fcs = fcs_start(f->fcsType);
+                raw = 0;
+                start = link_time(conn);
+                conn->rxPos--;
+                state = RX_DATA;
+                break;
+
+            default:
+
+                state = RX_HUNT;
+                break;
+        }
+    }
+}
+
+// Send a command and wait for the expected reply, retransmitting after
+// ll_params.timeout: the peer may not be there yet, and the round trip
+// time of the I-frames is not that of the commands. The reply is left in
+// "reply", whose buffer the caller provides.
+// Returns 0 on success, -1 if the peer never answered.
+static int command(struct ll_connection *conn, unsigned char a, unsigned char c,
+                   const unsigned char *info, size_t infoLen,
+                   unsigned char replyA, unsigned char replyC, struct rx_frame *reply){
+
+    for (int attempt = 0; attempt <= conn->params.nRetransmissions; attempt++){
+
+        if (attempt > 0)
+            conn->stats.retransmissions++;
+
+        if (send_control(conn, a, c, info, infoLen) < 0)
+            return -1;
+
+        int64_t deadline = link_time(conn) + conn->params.timeout * NSEC_PER_SEC;
+        int res;
+
+        while ((res = receive_frame(conn, reply, deadline)) > 0){
+
+            conn->stats.framesReceived++;
+
+            if (reply->a == replyA && reply->c == replyC && reply->fcsOk)
+                return 0;
+        }
+
+        if (res < 0)
+            return -1;
+
+        conn->stats.timeouts++;
+    }
+
+    return -1;
+}
+
+static int open_port(struct ll_connection *conn){
+
+    conn->fd = open(conn->params.serialPort, O_RDWR | O_NOCTTY);
+
+    if (conn->fd < 0){
+
+        perror(conn->params.serialPort);
+        return -1;
+    }
+
+    if (tcgetattr(conn->fd, &conn->oldtio) == -1){
+
+        perror("tcgetattr");
+        close(conn->fd);
+        return -1;
+    }
+
+    struct termios newtio;
+    memset(&newtio, 0, sizeof(newtio));
+
+    newtio.c_cflag = conn->params.baudRate | CS8 | CLOCAL | CREAD;
+    newtio.c_iflag = IGNPAR;
+    newtio.c_oflag = 0;
+    newtio.c_lflag = 0;
+    newtio.c_cc[VTIME] = 0;  // poll() or a sleep wait for input, until the
+    newtio.c_cc[VMIN] = 0;   // deadline; reads then take what has arrived
+
+    tcflush(conn->fd, TCIOFLUSH);
+
+    if (tcsetattr(conn->fd, TCSANOW, &newtio) == -1){
+
+        perror("tcsetattr");
+        close(conn->fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void close_port(struct ll_connection *conn){
+
+    // Let the last frame leave before the settings change
+    tcdrain(conn->fd);
+
+    if (tcsetattr(conn->fd, TCSANOW, &conn->oldtio) == -1)
+        perror("tcsetattr");
+
+    close(conn->fd);
+    cable_clock_close(conn->clock);
+}
+
+struct ll_connection *llopen(const struct ll_params *params){
+
+    struct ll_connection *conn = calloc(1, sizeof(*conn));
+
+    if (conn == NULL)
+        return NULL;
+
+    conn->params = *params;
+    conn->rto = params->timeout * NSEC_PER_SEC;
+
+    if (open_port(conn) < 0){
+
+        free(conn);
+        return NULL;
+    }
+
+    // Timeouts follow the cable's clock when there is one
+    conn->clock = cable_clock_open(params->serialPort);
+
+    // Each side offers the largest window it supports; the smaller is used.
+    // Selective Repeat is used if both ask for it.
+    int window = params->window < 1 ? 1 : params->window > LL_MAX_WINDOW ? LL_MAX_WINDOW : params->window;
+    int selective = params->selectiveRepeat ? TRUE : FALSE;
+    int fcs = params->fcs >= FCS_BCC2 && params->fcs <= FCS_CRC32 ? params->fcs : FCS_BCC2;
+    unsigned long maxPayload = params->maxPayload > 0 && params->maxPayload < LL_MAX_PAYLOAD
+                               ? params->maxPayload : LL_MAX_PAYLOAD;
+    unsigned char info[INFO_MAX];
+    struct rx_frame f = { .data = info, .size = sizeof(info) };
+
+    if (params->role == LL_TRANSMITTER){
+
+        size_t len = tlv_put(info, 0, TLV_WINDOW, window, 1);
+        len = tlv_put(info, len, TLV_ARQ, selective, 1);
+        len = tlv_put(info, len, TLV_FCS, fcs, 1);
+        len = tlv_put(info, len, TLV_PAYLOAD, maxPayload, 2);
+
+        if (command(conn, A_TX, C_SET, info, len, A_TX, C_UA, &f) < 0){
+
+            close_port(conn);
+            free(conn);
+            return NULL;
+        }
+
+        unsigned long offered = tlv_get(f.data, f.len, TLV_WINDOW, 1);
+        conn->window = offered < (unsigned long) window ? (int) offered : window;
+        conn->selective = selective && tlv_get(f.data, f.len, TLV_ARQ, 0) == 1;
+        conn->fcs = tlv_get(f.data, f.len, TLV_FCS, FCS_BCC2) == (unsigned long) fcs ? fcs : FCS_BCC2;
+        offered = tlv_get(f.data, f.len, TLV_PAYLOAD, LL_MAX_PAYLOAD);
+        conn->maxPayload = offered > 0 && offered < maxPayload ? offered : maxPayload;
+
+        if (conn->selective && conn->window > LL_MAX_SR_WINDOW)
+            conn->window = LL_MAX_SR_WINDOW;
+
+        return conn;
+    }
+
+    // Receiver: wait for SET, as long as it takes
+    while (receive_frame(conn, &f, NO_DEADLINE) > 0){
+
+        conn->stats.framesReceived++;
+
+        if (f.a == A_TX && f.c == C_SET && f.fcsOk){
+
+            unsigned long offered = tlv_get(f.data, f.len, TLV_WINDOW, 1);
+            conn->window = offered < (unsigned long) window ? (int) offered : window;
+            conn->selective = selective && tlv_get(f.data, f.len, TLV_ARQ, 0) == 1;
+
+            // The FCS is the transmitter's choice, any of them is checked
+            conn->fcs = tlv_get(f.data, f.len, TLV_FCS, FCS_BCC2);
+
+            if (conn->fcs > FCS_CRC32)
+                conn->fcs = FCS_BCC2;
+
+            // Our buffer, or less if the transmitter sends less; 0 is
+            // taken as LL_MAX_PAYLOAD, as in ll_params
+            offered = tlv_get(f.data, f.len, TLV_PAYLOAD, LL_MAX_PAYLOAD);
+            conn->maxPayload = offered > 0 && offered < maxPayload ? offered : maxPayload;
+
+            // Below half the modulus, so that a frame sent again is never
+            // taken for a new one with the same Ns, even one that a later
+            // frame overtook on the line
+            if (conn->selective && conn->window > LL_MAX_SR_WINDOW)
+                conn->window = LL_MAX_SR_WINDOW;
+
+            conn->uaLen = tlv_put(conn->ua, 0, TLV_WINDOW, conn->window, 1);
+            conn->uaLen = tlv_put(conn->ua, conn->uaLen, TLV_ARQ, conn->selective, 1);
+            conn->uaLen = tlv_put(conn->ua, conn->uaLen, TLV_FCS, conn->fcs, 1);
+            conn->uaLen = tlv_put(conn->ua, conn->uaLen, TLV_PAYLOAD, conn->maxPayload, 2);
+            send_control(conn, A_TX, C_UA, conn->ua, conn->uaLen);
+            return conn;
+        }
+    }
+
+    close_port(conn);
+    free(conn);
+    return NULL;
+}
+
+static void quality_sent(struct ll_connection *conn, size_t len){
+
+    conn->lost *= QUALITY_DECAY;
+    conn->lineBytes = conn->lineBytes * QUALITY_DECAY + len;
+}
+
+static double square_root(double x){
+
+    // Newton's method, from above
+    double r = x > 1 ? x : 1;
+
+    while (r * r - x > 1e-9 * x)
+        r = (r + x / r) / 2;
+
+    return r;
+}
+
+// Payload size with the highest expected goodput for the recent line
+// quality. With "lost" I-frames per byte, each lost frame sent again once,
+// and "overhead" bytes of flags, header and FCS per frame, the efficiency
+// of frames of "n" bytes, (n - overhead) / n * (1 - lost)^n, is highest
+// when n = overhead / 2 + sqrt(overhead^2 / 4 + overhead / lost).
+static size_t best_payload(struct ll_connection *conn){
+
+    double overhead = 5 + fcs_size(conn->fcs);
+
+    if (conn->lost * (overhead + conn->maxPayload) <= 1e-6 * conn->lineBytes)
+        return conn->maxPayload;
+
+    double n = overhead / 2 + square_root(overhead * overhead / 4 + overhead * conn->lineBytes / conn->lost);
+    double payload = n - overhead;
+
+    if (payload < PAYLOAD_MIN)
+        return PAYLOAD_MIN < conn->maxPayload ? PAYLOAD_MIN : conn->maxPayload;
+
+    return payload < conn->maxPayload ? (size_t) payload : conn->maxPayload;
+}
+
+// Send an I-frame again
+static int resend(struct ll_connection *conn, unsigned char ns){
+
+    if (write(conn->fd, conn->sent[ns], conn->sentLen[ns]) != (ssize_t) conn->sentLen[ns])
+        return -1;
+
+    conn->stats.framesSent++;
+    conn->stats.retransmissions++;
+    conn->resent |= 1u << ns;
+    quality_sent(conn, conn->sentLen[ns]);
+    return 0;
+}
+
+// Send the I-frames from "base" on again; in Selective Repeat, only "base",
+// as the receiver keeps the others
+static int go_back(struct ll_connection *conn){
+
+    for (unsigned char ns = conn->base; ns != conn->next; ns = (ns + 1) % SEQ_MODULUS){
+
+        if (resend(conn, ns) < 0)
+            return -1;
+
+        if (conn->selective)
+            break;
+    }
+
+    conn->deadline = deadline_after(conn);
+    return 0;
+}
+
+// SREJ asks for one I-frame in flight, the others are kept by the receiver.
+// Returns -1 after too many retransmissions of that frame.
+static int selective_reject(struct ll_connection *conn, unsigned char ns){
+
+    if (SEQ_DIST(conn->base, ns) >= SEQ_DIST(conn->base, conn->next))
+        return 0;
+
+    conn->stats.rejReceived++;
+    conn->lost++;
+
+    if (++conn->srejs[ns] > conn->params.nRetransmissions)
+        return -1;
+
+    // The timeout runs for "base": it starts again if that is the frame sent
+    if (ns == conn->base)
+        conn->deadline = deadline_after(conn);
+
+    return resend(conn, ns);
+}
+
+// RR and REJ acknowledge every I-frame before their Nr; after REJ, the
+// frames from Nr on are sent again.
+// Returns -1 after too many retransmissions without progress.
+static int acknowledge(struct ll_connection *conn, unsigned char c){
+
+    unsigned char nr = C_SEQ(c);
+
+    // Nr must be one of the frames in flight, or the next one
+    if (SEQ_DIST(conn->base, nr) > SEQ_DIST(conn->base, conn->next))
+        return 0;
+
+    if (nr != conn->base){
+
+        // The round trip of the last frame acknowledged, unless it was sent
+        // more than once and the RR may be for any of them
+        unsigned char last = (nr + SEQ_MODULUS - 1) % SEQ_MODULUS;
+
+        if (!(conn->resent & 1u << last))
+            rtt_sample(conn, link_time(conn) - conn->sentAt[last]);
+
+        conn->base = nr;
+        conn->retries = 0;
+        conn->deadline = deadline_after(conn);
+    }
+
+    if (IS_REJ(c) && conn->base != conn->next){
+
+        conn->stats.rejReceived++;
+        conn->lost++;
+
+        if (++conn->retries > conn->params.nRetransmissions)
+            return -1;
+
+        return go_back(conn);
+    }
+
+    return 0;
+}
+
+// Take an acknowledgement. An SREJ is only noted in "srej", 1 << Ns: an RR
+// behind it may show that the frame it asked for arrived late.
+// Returns -1 after too many retransmissions without progress.
+static int take_ack(struct ll_connection *conn, const struct rx_frame *f, unsigned *srej){
+
+    conn->stats.framesReceived++;
+
+    if (f->a != A_TX)
+        return 0;
+
+    if ((IS_RR(f->c) || IS_REJ(f->c)) && acknowledge(conn, f->c) < 0)
+        return -1;
+
+    if (IS_SREJ(f->c) && conn->selective)
+        *srej |= 1u << C_SEQ(f->c);
+
+    return 0;
+}
+
+// Take the acknowledgements already received, without waiting, then send
+// again the frames asked for with SREJ that are still in flight.
+// Returns 0, or -1 as take_ack() and selective_reject().
+static int read_acks(struct ll_connection *conn, unsigned srej){
+
+    struct rx_frame f = { .data = NULL, .size = 0 };
+    int res;
+
+    while ((res = receive_frame(conn, &f, link_time(conn))) > 0)
+        if (take_ack(conn, &f, &srej) < 0)
+            return -1;
+
+    if (res < 0)
+        return -1;
+
+    for (unsigned char ns = conn->base; ns != conn->next; ns = (ns + 1) % SEQ_MODULUS)
+        if (srej & 1u << ns && selective_reject(conn, ns) < 0)
+            return -1;
+
+    return 0;
+}
+
+// Handle the acknowledgements until fewer than "limit" I-frames are in
+// flight, going back to the oldest one on each timeout, which doubles.
+// Returns 0, or -1 if the receiver stopped answering.
+static int wait_acks(struct ll_connection *conn, int limit){
+
+    while (SEQ_DIST(conn->base, conn->next) >= limit){
+
+        struct rx_frame f = { .data = NULL, .size = 0 };
+        int res = receive_frame(conn, &f, conn->deadline);
+
+        if (res < 0)
+            return -1;
+
+        if (res == 0){
+
+            conn->stats.timeouts++;
+
+            // Before the first sample, a timeout may only mean that a frame
+            // takes longer than ll_params.timeout on the line
+            if (conn->srtt != 0)
+                conn->lost++;
+
+            rtt_backoff(conn);
+
+            if (++conn->retries > conn->params.nRetransmissions || go_back(conn) < 0)
+                return -1;
+
+            continue;
+        }
+
+        // This one, and those that arrived with it
+        unsigned srej = 0;
+
+        if (take_ack(conn, &f, &srej) < 0 || read_acks(conn, srej) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+int llwrite(struct ll_connection *conn, const unsigned char *buf, size_t length){
+
+    // The acknowledgements so far, then wait for room in the window
+    if (read_acks(conn, 0) < 0 || wait_acks(conn, conn->window) < 0)
+        return -1;
+
+    size_t payload = best_payload(conn);
+
+    if (length > payload)
+        length = payload;
+
+    // Build the frame once, stuffing the payload straight from "buf"
+    unsigned char ns = conn->next;
+    unsigned char *frame = conn->sent[ns];
+    unsigned char fcs[FCS_MAX];
+    size_t fcsLen = fcs_put(conn->fcs, fcs_update(conn->fcs, fcs_start(conn->fcs), buf, length), fcs);
+    size_t len = frame_header(frame, A_TX, C_I(ns));
+
+    len += stuff(frame + len, buf, length);
+    len += stuff(frame + len, fcs, fcsLen);
+    frame[len++] = FLAG;
+    conn->sentLen[ns] = len;
+    conn->srejs[ns] = 0;
+    conn->resent &= ~(1u << ns);
+    conn->sentAt[ns] = link_time(conn);
+
+    if (write(conn->fd, frame, len) != (ssize_t) len)
+        return -1;
+
+    conn->stats.framesSent++;
+    conn->stats.iFramesSent++;
+    quality_sent(conn, len);
+
+    if (conn->base == conn->next)
+        conn->deadline = deadline_after(conn);
+
+    conn->next = (ns + 1) % SEQ_MODULUS;
+    return length;
+}
+
+// Ask once for an I-frame with SREJ, until it arrives
+static void selective_ask(struct ll_connection *conn, unsigned char ns){
+
+    if (conn->srejSent & 1u << ns)
+        return;
+
+    conn->srejSent |= 1u << ns;
+    conn->stats.rejSent++;
+    send_supervision(conn, A_TX, C_SREJ(ns));
+}
+
+// Selective Repeat: an I-frame after a missing one is copied to its slot
+// and the missing ones are asked for; the frame expected, received in the
+// caller's buffer, is acknowledged with the ones kept after it.
+// Returns TRUE if "f" is the frame expected.
+static int selective_receive(struct ll_connection *conn, struct rx_frame *f){
+
+    unsigned char ns = C_SEQ(f->c);
+    int ahead = SEQ_DIST(conn->nr, ns);
+
+    if (ahead >= conn->window){
+
+        // Received again because our RR was lost
+        if (SEQ_DIST(ns, conn->nr) <= conn->window)
+            send_supervision(conn, A_TX, C_RR(conn->nr));
+
+        return FALSE;
+    }
+
+    if (conn->held & 1u << ns)
+        return FALSE;
+
+    if (!f->fcsOk){
+
+        // Also when it was already asked for: this was the frame sent again
+        conn->srejSent &= ~(1u << ns);
+        selective_ask(conn, ns);
+        return FALSE;
+    }
+
+    conn->srejSent &= ~(1u << ns);
+
+    if (ahead > 0){
+
+        memcpy(conn->slot[ns], f->data, f->len);
+        conn->slotLen[ns] = f->len;
+        conn->held |= 1u << ns;
+        conn->stats.outOfSequence++;
+
+        for (unsigned char k = conn->nr; k != ns; k = (k + 1) % SEQ_MODULUS)
+            if (!(conn->held & 1u << k))
+                selective_ask(conn, k);
+
+        return FALSE;
+    }
+
+    conn->nr = conn->out = (ns + 1) % SEQ_MODULUS;
+
+    while (conn->held & 1u << conn->nr)
+        conn->nr = (conn->nr + 1) % SEQ_MODULUS;
+
+    send_supervision(conn, A_TX, C_RR(conn->nr));
+    return TRUE;
+}
+
+int llread(struct ll_connection *conn, unsigned char *packet, size_t size){
+
+    // Frames kept for Selective Repeat, already acknowledged, come first
+    if (conn->out != conn->nr){
+
+        unsigned char ns = conn->out;
+
+        if (conn->slotLen[ns] > size)
+            return -1;
+
+        memcpy(packet, conn->slot[ns], conn->slotLen[ns]);
+        conn->held &= ~(1u << ns);
+        conn->out = (ns + 1) % SEQ_MODULUS;
+        return conn->slotLen[ns];
+    }
+
+    // No I-frame has more, and the slots have room for no more
+    struct rx_frame f = { .data = packet, .size = size < conn->maxPayload ? size : conn->maxPayload };
+
+    while (receive_frame(conn, &f, NO_DEADLINE) > 0){
+
+        conn->stats.framesReceived++;
+
+        if (f.a == A_TX && f.c == C_SET){
+
+            // Our UA was lost
+            send_control(conn, A_TX, C_UA, conn->ua, conn->uaLen);
+            continue;
+        }
+
+        if (f.a == A_TX && f.c == C_DISC){
+
+            conn->discReceived = TRUE;
+            return 0;
+        }
+
+        if (f.a != A_TX || !IS_I(f.c))
+            continue;
+
+        if (conn->selective){
+
+            if (selective_receive(conn, &f))
+                return f.len;
+
+            continue;
+        }
+
+        if (C_SEQ(f.c) != conn->nr && SEQ_DIST(C_SEQ(f.c), conn->nr) <= conn->window){
+
+            // Received before: our RR was lost, or the frame was still on
+            // its way when a REJ had it sent again. Another REJ would start
+            // yet another round of the same frames. With at most half the
+            // modulus in flight, no frame sent for the first time is as far
+            // behind.
+            conn->stats.outOfSequence++;
+            send_supervision(conn, A_TX, C_RR(conn->nr));
+            continue;
+        }
+
+        if (C_SEQ(f.c) != conn->nr || !f.fcsOk){
+
+            // Go-Back-N: only the next frame in sequence is accepted. Once
+            // per gap, the transmitter is asked to go back to it.
+            if (C_SEQ(f.c) != conn->nr)
+                conn->stats.outOfSequence++;
+
+            // A damaged copy of the frame asked for gets another REJ
+            if (!conn->rejSent || C_SEQ(f.c) == conn->nr){
+
+                conn->rejSent = TRUE;
+                conn->stats.rejSent++;
+                send_supervision(conn, A_TX, C_REJ(conn->nr));
+            }
+            continue;
+        }
+
+        conn->nr = conn->out = (conn->nr + 1) % SEQ_MODULUS;
+        conn->rejSent = FALSE;
+        send_supervision(conn, A_TX, C_RR(conn->nr));
+        return f.len;
+    }
+
+    return -1;
+}
+
+int llclose(struct ll_connection *conn, struct ll_statistics *stats){
+
+    int res = 0;
+    struct rx_frame f = { .data = NULL, .size = 0 };
+
+    if (conn->params.role == LL_TRANSMITTER){
+
+        // The I-frames in flight are acknowledged first
+        res = wait_acks(conn, 1);
+
+        if (res == 0)
+            res = command(conn, A_TX, C_DISC, NULL, 0, A_RX, C_DISC, &f);
+
+        if (res == 0)
+            send_supervision(conn, A_RX, C_UA);
+    }
+    else{
+
+        // Wait for the transmitter's DISC, if llread did not get it
+        unsigned char discard[LL_MAX_PAYLOAD];
+
+        while (!conn->discReceived && llread(conn, discard, sizeof(discard)) > 0)
+            ;
+
+        res = conn->discReceived ? command(conn, A_RX, C_DISC, NULL, 0, A_RX, C_UA, &f) : -1;
+    }
+
+    conn->stats.rttUsec = conn->srtt / 1000;
+
+    if (stats != NULL)
+        *stats = conn->stats;
+
+    close_port(conn);
+    free(conn);
+
+    return res;
+}
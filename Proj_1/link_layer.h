@@ -0,0 +1,94 @@
+// link_layer.h
+//
+// Data link layer over a serial port: Go-Back-N with I-frames numbered
+// modulo 16, acknowledged cumulatively with RR / REJ, and a SET / UA and
+// DISC / DISC / UA exchange to open and close the connection. Frames are
+// sent again after a timeout taken from the round trip time measured on the
+// RRs (Jacobson / Karels, RFC 6298), doubled on each expiry. The window is
+// negotiated in SET / UA; with a window of 1 this is stop-and-wait. So is
+// the largest payload, the receiver's buffer, and below it the transmitter
+// sizes each I-frame for the REJ and timeout rate it sees.
+//
+// In Selective Repeat mode, also negotiated, the receiver keeps the I-frames
+// that arrive after a missing one and asks for that one alone with SREJ; the
+// transmitter sends again only the frames asked for, and the oldest one on
+// a timeout. The window is then at most half the sequence modulus.
+//
+// Frames: FLAG A C BCC1 [data... FCS] FLAG, with FLAG and ESC in the rest
+// of the frame sent as ESC followed by the byte XORed with 0x20. The FCS of
+// the I-frames, chosen by the transmitter in SET, is the XOR of the data
+// (BCC2), a CRC-16 or a CRC-32; the other frames have a BCC2.
+//
+// Payloads are not copied: llwrite stuffs them straight from the caller's
+// buffer into the frame it sends, and llread destuffs straight into the
+// caller's buffer.
+
+#ifndef LINK_LAYER_H
+#define LINK_LAYER_H
+
+#include <stddef.h>
+
+#define LL_TRANSMITTER 0
+#define LL_RECEIVER 1
+
+#define LL_MAX_PAYLOAD 1024  // Bytes of data in an I-frame, at most
+#define LL_MAX_WINDOW 8      // I-frames in flight, half the sequence modulus
+#define LL_MAX_SR_WINDOW 7   // Same, in Selective Repeat mode
+
+// Frame check sequences of the I-frames
+#define LL_FCS_BCC2 0        // 8-bit XOR, misses two flips of the same bit
+#define LL_FCS_CRC16 1       // CRC-16-CCITT, as in HDLC
+#define LL_FCS_CRC32 2       // CRC-32, as in Ethernet
+
+struct ll_params {
+    const char *serialPort;  // e.g. "/dev/ttyS10"
+    int role;                // LL_TRANSMITTER or LL_RECEIVER
+    int baudRate;            // termios speed, e.g. B38400
+    int nRetransmissions;    // Retransmissions without progress before giving up
+    int timeout;             // Seconds before retransmitting SET and DISC, and
+                             // I-frames until the round trip time is measured
+    int window;              // Largest window accepted, 1 to LL_MAX_WINDOW
+    int selectiveRepeat;     // Non-zero to use Selective Repeat if the peer agrees
+    int fcs;                 // LL_FCS_..., chosen by the transmitter
+    int maxPayload;          // Largest payload of an I-frame: the receiver's
+                             // buffer, or the most the transmitter sends;
+                             // 0 for LL_MAX_PAYLOAD
+};
+
+struct ll_statistics {
+    unsigned long framesSent, framesReceived;
+    unsigned long iFramesSent;  // Not counting retransmissions
+    unsigned long retransmissions, timeouts;
+    unsigned long rejSent, rejReceived;    // REJ, or SREJ in Selective Repeat
+    unsigned long outOfSequence;  // I-frames received out of order: dropped,
+                                  // or kept for later in Selective Repeat
+    unsigned long rttUsec;        // Smoothed round trip time, 0 if unknown
+};
+
+// Connection handle, one per serial port
+struct ll_connection;
+
+// Open the serial port and establish the connection (SET / UA).
+// Returns NULL on failure.
+struct ll_connection *llopen(const struct ll_params *params);
+
+// Send up to "length" bytes in one I-frame. Its payload is the size with the
+// highest expected goodput for the recent REJ and timeout rate, at most the
+// largest payload negotiated, so fewer bytes may be sent; the caller sends
+// the rest with the following calls. Waits only while the window is full;
+// llclose waits for the rest to be acknowledged.
+// Returns the number of bytes sent, or -1 on failure.
+int llwrite(struct ll_connection *conn, const unsigned char *buf, size_t length);
+
+// Receive the payload of the next I-frame into "packet", of "size" bytes.
+// Returns the number of bytes received, 0 when the transmitter disconnects
+// (llclose should follow), or -1 on failure.
+int llread(struct ll_connection *conn, unsigned char *packet, size_t size);
+
+// Terminate the connection (DISC / DISC / UA) once every I-frame sent is
+// acknowledged, restore and close the serial port. The statistics are
+// copied to "stats" if not NULL.
+// Returns 0 on success, -1 if the peer did not answer.
+int llclose(struct ll_connection *conn, struct ll_statistics *stats);
+
+#endif
@@ -0,0 +1,112 @@
+// stuffing.c
+#include <stdint.h>
+#include <string.h>
+#include "stuffing.h"
+
+#define FALSE 0
+#define TRUE 1
+
+#define ONES 0x0101010101010101ULL
+#define LOWS 0x7F7F7F7F7F7F7F7FULL
+
+// High bit set in exactly the bytes of "w" equal to "byte". The low seven
+// bits of each byte are added apart, so no carry crosses into the next one
+// and the result holds on either byte order.
+static uint64_t match(uint64_t w, unsigned char byte){
+
+    uint64_t x = w ^ (ONES * byte);
+    return ~(((x & LOWS) + LOWS) | x | LOWS);
+}
+
+// Position in memory of the first byte flagged in "mask"
+static size_t first_match(uint64_t mask){
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return __builtin_clzll(mask) / 8;
+#else
+    return __builtin_ctzll(mask) / 8;
+#endif
+}
+
+// Number of bytes of "p" before the first one that is ESC, or FLAG too if
+// "flags" is TRUE; "n" if there is none
+static size_t clean_run(const unsigned char *p, size_t n, int flags){
+
+    size_t k = 0;
+
+    for (; k + 8 <= n; k += 8){
+
+        uint64_t w;
+        memcpy(&w, p + k, 8);
+
+        uint64_t mask = match(w, ESC) | (flags ? match(w, FLAG) : 0);
+
+        if (mask != 0)
+            return k + first_match(mask);
+    }
+
+    for (; k < n; k++)
+        if (p[k] == ESC || (flags && p[k] == FLAG))
+            return k;
+
+    return n;
+}
+
+size_t stuff(unsigned char *dst, const unsigned char *src, size_t n){
+
+    size_t in = 0, out = 0;
+
+    while (in < n){
+
+        size_t run = clean_run(src + in, n - in, TRUE);
+
+        memcpy(dst + out, src + in, run);
+        in += run;
+        out += run;
+
+        if (in < n){
+
+            dst[out++] = ESC;
+            dst[out++] = src[in++] ^ ESC_XOR;
+        }
+    }
+
+    return out;
+}
+
+size_t destuff(unsigned char *dst, const unsigned char *src, size_t n, int *escaped){
+
+    size_t in = 0, out = 0;
+
+    if (*escaped && n > 0){
+
+        dst[out++] = src[in++] ^ ESC_XOR;
+        *escaped = FALSE;
+    }
+
+    while (in < n){
+
+        size_t run = clean_run(src + in, n - in, FALSE);
+
+        memcpy(dst + out, src + in, run);
+        in += run;
+        out += run;
+
+        if (in < n){
+
+            // Skip the ESC; the byte it escapes may be in the next piece
+            if (++in < n)
+                dst[out++] = src[in++] ^ ESC_XOR;
+            else
+                *escaped = TRUE;
+        }
+    }
+
+    return out;
+}
+
+size_t find_flag(const unsigned char *p, size_t n){
+
+    const unsigned char *flag = memchr(p, FLAG, n);
+    return flag != NULL ? (size_t) (flag - p) : n;
+}
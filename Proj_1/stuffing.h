@@ -0,0 +1,33 @@
+// stuffing.h
+//
+// Byte stuffing of the frames: between the flags, FLAG (0x7E) and ESC (0x7D)
+// are sent as ESC followed by the byte XORed with 0x20.
+// The buffers are scanned eight bytes at a time for the bytes to escape,
+// and the runs between them are copied with memcpy.
+
+#ifndef STUFFING_H
+#define STUFFING_H
+
+#include <stddef.h>
+
+#define FLAG 0x7E
+#define ESC 0x7D
+#define ESC_XOR 0x20
+
+// Worst case size of "n" bytes once stuffed: every one of them escaped
+#define STUFFED_MAX(n) (2 * (n))
+
+// Stuff "n" bytes of "src" into "dst", which must have room for
+// STUFFED_MAX(n) bytes. Returns the number of bytes written.
+size_t stuff(unsigned char *dst, const unsigned char *src, size_t n);
+
+// Destuff "n" bytes of a frame, without its flags, into "dst", which must
+// have room for "n" bytes. A frame may be destuffed in pieces: "*escaped"
+// carries an ESC ending one piece over to the next, and should be FALSE for
+// the first one. Returns the number of bytes written.
+size_t destuff(unsigned char *dst, const unsigned char *src, size_t n, int *escaped);
+
+// Number of bytes of "p" before the first FLAG, "n" if there is none
+size_t find_flag(const unsigned char *p, size_t n);
+
+#endif